@@ -27,6 +27,7 @@ const PROGMEM char* server_conf = "/server.json";
 const PROGMEM char* unit_conf = "/unit.json";
 const PROGMEM char* console_file = "/console.log";
 const PROGMEM char* others_conf = "/others.json";
+const PROGMEM char* config_blob = "/config.bin";
 // pinouts
 const PROGMEM  uint8_t blueLedPin = 2;            // The ESP32 has an internal blue LED at D2 (GPIO 02)
 #else
@@ -35,6 +36,7 @@ const PROGMEM char* server_conf = "mqtt.json";
 const PROGMEM char* unit_conf = "unit.json";
 const PROGMEM char* console_file = "console.log";
 const PROGMEM char* others_conf = "others.json";
+const PROGMEM char* config_blob = "config.bin";
 // pinouts
 const PROGMEM  uint8_t blueLedPin = LED_BUILTIN; // Onboard LED = digital pin 2 "D4" (blue LED on WEMOS D1-Mini)
 #endif
@@ -43,20 +45,57 @@ const PROGMEM  uint8_t blueLedPin = LED_BUILTIN; // Onboard LED = digital pin 2
 
 // Define global variables for network
 const PROGMEM char* hostnamePrefix = "HVAC_";
-const PROGMEM uint32_t WIFI_RETRY_INTERVAL_MS = 300000;
-unsigned long wifi_timeout;
+const PROGMEM uint32_t WIFI_CONNECT_TIMEOUT_MS = 30000; // give up a connection attempt, and open the fallback AP, after this delay
+const PROGMEM uint32_t WIFI_RETRY_MIN_MS = 5000;        // first delay between attempts, doubled each time
+const PROGMEM uint32_t WIFI_RETRY_INTERVAL_MS = 300000; // maximum delay between attempts
 bool wifi_config_exists;
-String hostname = "";
-String ap_ssid;
-String ap_pwd;
-String ota_pwd;
+FixedString<32> hostname;
+FixedString<32> ap_ssid;
+FixedString<64> ap_pwd;
+FixedString<32> ota_pwd;
+
+// Last good connection, see wifiBegin()
+uint8_t wifi_bssid[6];
+uint8_t wifi_channel = 0;
+const PROGMEM uint32_t WIFI_FAST_CONNECT_TIMEOUT_MS = 5000; // fall back to a full scan after this delay
+const PROGMEM uint32_t WIFI_SCAN_TIMEOUT_MS = 10000;
+
+// Other networks, tried when the first one (ap_ssid) is not available
+FixedString<32> wifi_ssid[WIFI_MAX_NETWORKS - 1];
+FixedString<64> wifi_pwd[WIFI_MAX_NETWORKS - 1];
+WifiHistory wifi_history[WIFI_MAX_NETWORKS];
+uint8_t wifi_network = 0;
+// Move to a stronger access point of a known network when the signal is weak
+bool wifi_roaming = false;
+const PROGMEM uint32_t WIFI_ROAM_CHECK_MS = 60000;
+const PROGMEM int32_t WIFI_ROAM_RSSI = -75;   // dBm
+const PROGMEM int32_t WIFI_ROAM_MARGIN = 8;   // dB
 
 // Define global variables for server
-String server_url;
+FixedString<128> server_url;
+bool server_msgpack = false;  // push MessagePack instead of JSON
+
+// Webhooks registered with /subscriptions, each one on its own asynchronous connection so a slow target only delays itself
+SubscriptionRecord subscriptions[SUBSCRIPTION_MAX];
+const PROGMEM uint16_t SUB_TIMEOUT_MS = 1000;   // checked on each poll of the connection (0.5 s), the name lookup has the lwIP timeout
+const PROGMEM uint32_t SUB_BACKOFF_MIN_MS = 2000;
+const PROGMEM uint32_t SUB_BACKOFF_MAX_MS = 300000;
+
+// MQTT broker, only used when built with -D USE_MQTT. Empty server disables it.
+FixedString<64> mqtt_server;
+uint16_t mqtt_port = 1883;
+FixedString<32> mqtt_user;
+FixedString<32> mqtt_pwd;
+FixedString<32> mqtt_topic = "mitsubishi2wifi";
+
+// Multicast announcements of the state, 0 disables them
+uint32_t mcast_group = 0;
+uint16_t mcast_port = 4211;
+const PROGMEM uint32_t MCAST_HEARTBEAT_MS = 30000; // full state again for late listeners
 
 //login
 String login_username = "admin";
-String login_password;
+FixedString<32> login_password;
 
 // debug mode logs, when true, will send all debug messages to topic heatpump_debug_logs_topic
 // this can also be set by sending "on" to heatpump_debug_set_topic
@@ -68,17 +107,40 @@ bool _debugModePckts = false;
 // Customization
 uint8_t min_temp                    = 16; // Minimum temperature, in your selected unit, check value from heatpump remote control
 uint8_t max_temp                    = 31; // Maximum temperature, in your selected unit, check value from heatpump remote control
-String temp_step                   = "1"; // Temperature setting step, check value from heatpump remote control
+FixedString<4> temp_step           = "1"; // Temperature setting step, check value from heatpump remote control
 
 // sketch settings
 const PROGMEM uint32_t PREVENT_UPDATE_INTERVAL_MS = 3000;  // interval to prevent application setting change after send settings to HP
 const PROGMEM uint32_t SEND_ROOM_TEMP_INTERVAL_MS = 300000; // 5 mn, anything less than 45 seconds may cause bouncing
 const PROGMEM uint32_t CHECK_REMOTE_TEMP_INTERVAL_MS = 300000; //5 minutes
-const PROGMEM uint32_t MQTT_RETRY_INTERVAL_MS = 1000; // 1 second
+// remote temperature from external sensors, by /json or UDP
+const PROGMEM uint16_t REMOTE_TEMP_UDP_PORT = 4210;
+const PROGMEM float REMOTE_TEMP_FILTER_WEIGHT = 0.3;         // weight of a new reading in the smoothing
+const PROGMEM float REMOTE_TEMP_DEADBAND = 0.3;              // Celsius, smaller changes are not forwarded
+const PROGMEM uint32_t REMOTE_TEMP_MAX_INTERVAL_MS = 120000; // forward anyway after 2 minutes
+const PROGMEM float REMOTE_TEMP_MIN = -10;                   // readings outside this range are ignored
+const PROGMEM float REMOTE_TEMP_MAX = 50;
+const PROGMEM uint32_t MQTT_RETRY_INTERVAL_MS = 5000; // 5 seconds
+const PROGMEM uint32_t MQTT_BATCH_INTERVAL_MS = 500;  // state changes within this window are sent as one message
 const PROGMEM uint32_t HP_RETRY_INTERVAL_MS = 1000; // 1 second
 const PROGMEM uint32_t HP_MAX_RETRIES = 10; // Double the interval between retries up to this many times, then keep retrying forever at that maximum interval.
 // Default values give a final retry interval of 1000ms * 2^10, which is 1024 seconds, about 17 minutes. 
 
+// CN105 polling, fast after a command or while the compressor ramps, slow when idle.
+// Replies from the unit are always read as soon as they arrive.
+uint16_t hp_poll_fast_ms = 500;
+uint16_t hp_poll_slow_ms = 4000;
+const PROGMEM uint32_t HP_POLL_ACTIVE_MS = 30000; // stay fast this long after the last activity
+const PROGMEM uint16_t HP_POLL_MIN_MS = 100;
+const PROGMEM uint16_t HP_POLL_MAX_MS = 8000;    // the library reconnects after 10s without a reply
+
+// CN105 task and its queues, the task is only used on dual core ESP32
+#define HP_EVENTS_PER_LOOP 4       // per subscriber of the event bus
+#define HP_TASK_STACK_SIZE 4096
+#define HP_TASK_PRIORITY 2
+#define HP_TASK_CORE 0            // loop() runs on core 1
+#define HP_TASK_PERIOD_MS 10
+
 // temp settings
 bool useFahrenheit = false;
 // support heat mode settings, some model do not support heat mode
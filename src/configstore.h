@@ -0,0 +1,86 @@
+#pragma once
+#include <Arduino.h>
+#include <stddef.h>
+#include "fixedstring.h"
+
+#define CONFIG_MAGIC 0x4957324D // "M2WI"
+#define CONFIG_VERSION 8
+#define WIFI_MAX_NETWORKS 4
+#define SUBSCRIPTION_MAX 4
+
+// Connection history of a wifi network, used to rank them
+struct WifiHistory {
+  uint16_t connectMs;                   // smoothed connection time
+  int8_t rssi;                          // signal at the last connection
+  uint8_t failures;                     // failed attempts since the last connection
+};
+
+// Webhook registered with /subscriptions
+struct SubscriptionRecord {
+  FixedString<128> url;                 // empty when the slot is free
+  uint16_t fields = 0;                  // mask of the subFieldNames indexes
+  uint32_t interval_ms = 0;             // minimum time between two deliveries
+};
+
+// Whole device configuration, written to config_blob as raw bytes.
+// Fields are only ever appended: a record written by an older firmware is
+// shorter, it is still loaded and the new fields keep their defaults.
+struct ConfigRecord {
+  uint32_t magic = CONFIG_MAGIC;
+  uint16_t version = CONFIG_VERSION;
+  uint16_t size = sizeof(ConfigRecord);
+  uint32_t crc = 0;                     // crc32 of everything after the header
+
+  // wifi
+  FixedString<32> hostname;
+  FixedString<32> ap_ssid;
+  FixedString<64> ap_pwd;
+  FixedString<32> ota_pwd;
+  // server
+  FixedString<128> server_url;
+  // unit
+  FixedString<32> login_password;
+  FixedString<4> temp_step = "1";
+  uint8_t min_temp = 16;
+  uint8_t max_temp = 31;
+  bool useFahrenheit = false;
+  bool supportHeatMode = true;
+  // others
+  bool debugModePckts = false;
+  bool debugModeLogs = false;
+
+  // version 2, last good wifi connection for a fast reconnect
+  uint8_t wifi_bssid[6] = {0};
+  uint8_t wifi_channel = 0;              // 0 when nothing is cached
+  uint32_t reserved_lease[4] = {0};     // was the last DHCP lease, no longer used
+
+  // version 3, other networks (the first one is ap_ssid) and their history
+  FixedString<32> wifi_ssid[WIFI_MAX_NETWORKS - 1];
+  FixedString<64> wifi_pwd[WIFI_MAX_NETWORKS - 1];
+  WifiHistory wifi_history[WIFI_MAX_NETWORKS] = {};
+  uint8_t wifi_network = 0;             // network of the cached connection
+  bool wifi_roaming = false;
+
+  // version 4, CN105 polling intervals
+  uint16_t hp_poll_fast_ms = 500;
+  uint16_t hp_poll_slow_ms = 4000;
+
+  // version 5, MQTT broker
+  FixedString<64> mqtt_server;
+  uint16_t mqtt_port = 1883;
+  FixedString<32> mqtt_user;
+  FixedString<32> mqtt_pwd;
+  FixedString<32> mqtt_topic = "mitsubishi2wifi";
+
+  // version 6, multicast announcements
+  uint32_t mcast_group = 0;
+  uint16_t mcast_port = 4211;
+
+  // version 7, push format
+  bool server_msgpack = false;
+
+  // version 8, webhook subscriptions
+  SubscriptionRecord subscriptions[SUBSCRIPTION_MAX];
+};
+
+#define CONFIG_HEADER_SIZE offsetof(ConfigRecord, hostname)
@@ -0,0 +1,53 @@
+#include "eventbus.h"
+
+bool HpEventBus::subscribe(const char* name, uint32_t mask, HpEventHandler handler) {
+  uint8_t n = count.load(std::memory_order_relaxed);
+  if (n >= HP_BUS_MAX_SUBSCRIBERS) return false;
+
+  Subscriber& subscriber = subscribers[n];
+  subscriber.name = name;
+  subscriber.mask = mask;
+  subscriber.handler = handler;
+  subscriber.delivered = 0;
+  // The publisher only sees the subscriber once it is complete
+  count.store(n + 1, std::memory_order_release);
+  return true;
+}
+
+void HpEventBus::publish(const HpEvent& event) {
+  uint8_t n = count.load(std::memory_order_acquire);
+  for (uint8_t i = 0; i < n; i++) {
+    if (subscribers[i].mask & HP_EVENT_MASK(event.type)) {
+      subscribers[i].queue.push(event);
+    }
+  }
+}
+
+// Deliver at most maxPerSubscriber events to each subscriber, so one busy sink can't hold loop()
+void HpEventBus::dispatch(uint8_t maxPerSubscriber) {
+  uint8_t n = count.load(std::memory_order_acquire);
+  HpEvent event;
+  for (uint8_t i = 0; i < n; i++) {
+    Subscriber& subscriber = subscribers[i];
+    for (uint8_t j = 0; j < maxPerSubscriber && subscriber.queue.pop(event); j++) {
+      subscriber.handler(event);
+      subscriber.delivered++;
+    }
+  }
+}
+
+// One line per subscriber, for the status page
+String HpEventBus::report() {
+  String out;
+  uint8_t n = count.load(std::memory_order_acquire);
+  for (uint8_t i = 0; i < n; i++) {
+    out += "<br/>";
+    out += subscribers[i].name;
+    out += ": ";
+    out += String(subscribers[i].delivered);
+    out += " delivered, ";
+    out += String(subscribers[i].queue.dropped());
+    out += " dropped";
+  }
+  return out;
+}
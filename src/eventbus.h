@@ -0,0 +1,39 @@
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+#include "hpstate.h"
+#include "spscqueue.h"
+
+// Sinks (push, MQTT, ...) and the events each of them can queue before dropping
+#define HP_BUS_MAX_SUBSCRIBERS 5
+#define HP_BUS_QUEUE_SIZE 8
+
+#define HP_EVENT_MASK(type) (1UL << (type))
+#define HP_EVENT_ALL 0xFFFFFFFFUL
+
+typedef void (*HpEventHandler)(const HpEvent& event);
+
+// Fan out of the CN105 events, never allocates.
+// Publishing copies the event in the queue of each interested subscriber and never waits,
+// a slow subscriber only loses its own events.
+class HpEventBus {
+  public:
+    // loop() side
+    bool subscribe(const char* name, uint32_t mask, HpEventHandler handler);
+    void dispatch(uint8_t maxPerSubscriber);
+    String report();
+
+    // CN105 side
+    void publish(const HpEvent& event);
+
+  private:
+    struct Subscriber {
+      const char* name;
+      uint32_t mask;
+      HpEventHandler handler;
+      uint32_t delivered;
+      SpscQueue<HpEvent, HP_BUS_QUEUE_SIZE> queue;
+    };
+    Subscriber subscribers[HP_BUS_MAX_SUBSCRIBERS];
+    std::atomic<uint8_t> count{0};
+};
@@ -0,0 +1,42 @@
+#pragma once
+#include <Arduino.h>
+
+// String with its storage inline, for settings which live for the whole uptime.
+// Never allocates, values longer than N characters are truncated.
+template <size_t N>
+class FixedString {
+  public:
+    FixedString() { buf[0] = '\0'; }
+    FixedString(const char* s) { assign(s); }
+
+    FixedString& operator=(const char* s) { assign(s); return *this; }
+    FixedString& operator=(const String& s) { assign(s.c_str()); return *this; }
+    FixedString& operator+=(const char* s) { append(s); return *this; }
+    FixedString& operator+=(const String& s) { append(s.c_str()); return *this; }
+
+    bool operator==(const char* s) const { return strcmp(buf, s ? s : "") == 0; }
+    bool operator==(const String& s) const { return strcmp(buf, s.c_str()) == 0; }
+    bool operator!=(const char* s) const { return !(*this == s); }
+    bool operator!=(const String& s) const { return !(*this == s); }
+    char operator[](size_t i) const { return buf[i]; }
+
+    const char* c_str() const { return buf; }
+    size_t length() const { return strlen(buf); }
+    bool isEmpty() const { return buf[0] == '\0'; }
+    static constexpr size_t capacity() { return N; }
+
+  private:
+    void assign(const char* s) {
+      if (s == buf) return;
+      buf[0] = '\0';
+      append(s);
+    }
+    void append(const char* s) {
+      if (!s) return;
+      size_t len = strlen(buf);
+      while (len < N && *s) buf[len++] = *s++;
+      buf[len] = '\0';
+    }
+
+    char buf[N + 1];
+};
@@ -0,0 +1,317 @@
+#include "heapstats.h"
+#include <ArduinoJson.h>
+#ifndef ESP32
+#include <umm_malloc/umm_malloc_cfg.h>
+#endif
+
+static HeapSlot heapSlots[HEAP_MAX_SLOTS];
+static uint8_t heapSlotCount = 0;
+#ifdef ESP32
+// Pages are served from the network task, each task has its own chain of scopes
+static thread_local HeapScope* heapCurrent = nullptr;
+// The slots are shared by the tasks, registration and updates are short critical sections
+static portMUX_TYPE heapSlotsMux = portMUX_INITIALIZER_UNLOCKED;
+#define HEAP_SLOTS_LOCK() portENTER_CRITICAL(&heapSlotsMux)
+#define HEAP_SLOTS_UNLOCK() portEXIT_CRITICAL(&heapSlotsMux)
+// malloc() is also called from interrupts, the counters use their own lock
+static portMUX_TYPE heapCountMux = portMUX_INITIALIZER_UNLOCKED;
+#define HEAP_COUNT_LOCK() portENTER_CRITICAL_SAFE(&heapCountMux)
+#define HEAP_COUNT_UNLOCK() portEXIT_CRITICAL_SAFE(&heapCountMux)
+#else
+#define HEAP_SLOTS_LOCK()
+#define HEAP_SLOTS_UNLOCK()
+#define HEAP_COUNT_LOCK()
+#define HEAP_COUNT_UNLOCK()
+static HeapScope* heapCurrent = nullptr;
+#endif
+
+static uint32_t heapAllocs = 0;
+static uint32_t heapFrees = 0;
+static uint32_t heapAllocBytes = 0;
+static HeapTask heapTasks[HEAP_MAX_TASKS];
+static uint8_t heapTaskCount = 0;
+
+static uint32_t heapHistory[HEAP_HISTORY_SIZE];
+static uint8_t heapHistoryPos = 0;
+static uint8_t heapHistoryCount = 0;
+static uint32_t heapLastSample = 0;
+static uint32_t heapMinLargestBlock = 0xFFFFFFFF;
+static uint32_t heapMinFree = 0xFFFFFFFF;
+
+uint32_t heapFree() {
+#ifdef ESP32
+  return heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+#else
+  return ESP.getFreeHeap();
+#endif
+}
+
+uint32_t heapTotal() {
+#ifdef ESP32
+  return heap_caps_get_total_size(MALLOC_CAP_DEFAULT);
+#else
+  // umm_malloc gets the RAM from the end of the sketch data to the system area
+  return UMM_MALLOC_CFG_HEAP_SIZE;
+#endif
+}
+
+uint32_t heapLargestBlock() {
+#ifdef ESP32
+  return heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT);
+#else
+  return ESP.getMaxFreeBlockSize();
+#endif
+}
+
+// Called with the slots locked
+static HeapSlot* heapSlot(const char* name) {
+  for (uint8_t i = 0; i < heapSlotCount; i++) {
+    if (heapSlots[i].name == name || strcmp(heapSlots[i].name, name) == 0) return &heapSlots[i];
+  }
+  if (heapSlotCount >= HEAP_MAX_SLOTS) return nullptr;
+  // Counted once complete, heapReport() reads the slots without the lock
+  HeapSlot* slot = &heapSlots[heapSlotCount];
+  memset(slot, 0, sizeof(HeapSlot));
+  slot->name = name;
+  heapSlotCount++;
+  return slot;
+}
+
+HeapScope::HeapScope(const char* name) {
+  HEAP_SLOTS_LOCK();
+  slot = heapSlot(name);
+  HEAP_SLOTS_UNLOCK();
+  parent = heapCurrent;
+  startFree = minFree = heapFree();
+  heapCurrent = this;
+}
+
+HeapScope::~HeapScope() {
+  uint32_t endFree = heapFree();
+  sample(endFree);
+  heapCurrent = parent;
+  if (parent) {
+    // The allocations are counted in the innermost scope, the outer ones include them on exit
+    parent->sample(minFree);
+    parent->allocs += allocs;
+    parent->allocBytes += allocBytes;
+    if (parent->liveBytes + peakLive > parent->peakLive) parent->peakLive = parent->liveBytes + peakLive;
+    parent->liveBytes += liveBytes;
+  }
+
+  if (!slot) return;
+  int32_t delta = (int32_t)startFree - (int32_t)endFree;
+  HEAP_SLOTS_LOCK();
+  slot->calls++;
+  if (delta > 0) slot->grows++;
+  slot->lastDelta = delta;
+  slot->retained += delta;
+  if (startFree - minFree > slot->peak) slot->peak = startFree - minFree;
+  slot->allocs += allocs;
+  slot->allocBytes += allocBytes;
+  if ((uint32_t)peakLive > slot->allocPeak) slot->allocPeak = peakLive;
+  HEAP_SLOTS_UNLOCK();
+}
+
+// Called with the counters locked, never allocates
+static HeapTask* heapTask(void* task) {
+  for (uint8_t i = 0; i < heapTaskCount; i++) {
+    if (heapTasks[i].task == task) return &heapTasks[i];
+  }
+  // The last entry takes the tasks which don't fit
+  if (heapTaskCount >= HEAP_MAX_TASKS) return &heapTasks[HEAP_MAX_TASKS - 1];
+  HeapTask* entry = &heapTasks[heapTaskCount];
+  memset(entry, 0, sizeof(HeapTask));
+  entry->task = task;
+#ifdef ESP32
+  strncpy(entry->name, task ? pcTaskGetTaskName(nullptr) : "other", sizeof(entry->name) - 1);
+#else
+  strncpy(entry->name, "loop", sizeof(entry->name) - 1);
+#endif
+  if (heapTaskCount == HEAP_MAX_TASKS - 1) strncpy(entry->name, "others", sizeof(entry->name) - 1);
+  heapTaskCount++;
+  return entry;
+}
+
+// Accounting of the wrapped allocator, sizes are the blocks really taken from the heap
+static void heapAccount(size_t allocated, size_t released) {
+#ifdef ESP32
+  // The task storage isn't set up before the scheduler, and an interrupt doesn't belong to the task it stopped
+  bool inTask = xTaskGetSchedulerState() != taskSCHEDULER_NOT_STARTED && !xPortInIsrContext();
+  void* task = inTask ? (void*)xTaskGetCurrentTaskHandle() : nullptr;
+#else
+  bool inTask = true;
+  void* task = nullptr;
+#endif
+
+  HEAP_COUNT_LOCK();
+  if (allocated) {
+    heapAllocs++;
+    heapAllocBytes += allocated;
+  }
+  if (released) heapFrees++;
+  HeapTask* entry = heapTask(task);
+  if (allocated) {
+    entry->allocs++;
+    entry->allocBytes += allocated;
+  }
+  if (released) entry->frees++;
+  HEAP_COUNT_UNLOCK();
+
+  if (inTask && heapCurrent) heapCurrent->account(allocated, released);
+}
+
+#ifdef ESP32
+// Size of a block in the heap, 0 for nullptr
+static size_t heapBlockSize(void* ptr) {
+  return ptr ? heap_caps_get_allocated_size(ptr) : 0;
+}
+#endif
+
+// Linked with -Wl,--wrap=malloc... (platformio.ini), every malloc()/new/String of the firmware and the
+// libraries goes through these. ESP8266 has no block size query, the size is the free heap difference.
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+
+void* __wrap_malloc(size_t size) {
+#ifdef ESP32
+  void* ptr = __real_malloc(size);
+  if (ptr) heapAccount(heapBlockSize(ptr), 0);
+#else
+  uint32_t before = heapFree();
+  void* ptr = __real_malloc(size);
+  if (ptr) heapAccount(before - heapFree(), 0);
+#endif
+  return ptr;
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+#ifdef ESP32
+  void* ptr = __real_calloc(count, size);
+  if (ptr) heapAccount(heapBlockSize(ptr), 0);
+#else
+  uint32_t before = heapFree();
+  void* ptr = __real_calloc(count, size);
+  if (ptr) heapAccount(before - heapFree(), 0);
+#endif
+  return ptr;
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+#ifdef ESP32
+  size_t oldSize = heapBlockSize(ptr);
+  void* moved = __real_realloc(ptr, size);
+  // On failure the old block is still there, realloc(ptr, 0) frees it
+  if (moved) heapAccount(heapBlockSize(moved), oldSize);
+  else if (size == 0) heapAccount(0, oldSize);
+#else
+  uint32_t before = heapFree();
+  void* moved = __real_realloc(ptr, size);
+  int32_t taken = (int32_t)(before - heapFree());
+  if (moved || size == 0) heapAccount(taken > 0 ? taken : 0, taken < 0 ? -taken : 0);
+#endif
+  return moved;
+}
+
+void __wrap_free(void* ptr) {
+  if (!ptr) return;
+#ifdef ESP32
+  size_t size = heapBlockSize(ptr);
+  __real_free(ptr);
+  heapAccount(0, size);
+#else
+  uint32_t before = heapFree();
+  __real_free(ptr);
+  heapAccount(0, heapFree() - before);
+#endif
+}
+}
+
+void HeapScope::sample(uint32_t freeNow) {
+  if (freeNow < minFree) minFree = freeNow;
+}
+
+// Only called by the task which owns the scope
+void HeapScope::account(size_t allocated, size_t released) {
+  if (allocated) {
+    allocs++;
+    allocBytes += allocated;
+  }
+  liveBytes += (int32_t)allocated - (int32_t)released;
+  if (liveBytes > peakLive) peakLive = liveBytes;
+}
+
+// Call where big temporaries are alive (page rendering, json serialisation)
+void heapTrackSample() {
+  uint32_t freeNow = heapFree();
+  if (freeNow < heapMinFree) heapMinFree = freeNow;
+  if (heapCurrent) heapCurrent->sample(freeNow);
+}
+
+void heapTick() {
+  if (heapHistoryCount > 0 && millis() - heapLastSample < HEAP_SAMPLE_INTERVAL_MS) return;
+  heapLastSample = millis();
+
+  uint32_t largest = heapLargestBlock();
+  if (largest < heapMinLargestBlock) heapMinLargestBlock = largest;
+  heapTrackSample();
+
+  heapHistory[heapHistoryPos] = largest;
+  heapHistoryPos = (heapHistoryPos + 1) % HEAP_HISTORY_SIZE;
+  if (heapHistoryCount < HEAP_HISTORY_SIZE) heapHistoryCount++;
+}
+
+String heapReport() {
+  DynamicJsonDocument doc(JSON_OBJECT_SIZE(12) + JSON_ARRAY_SIZE(HEAP_MAX_SLOTS) + HEAP_MAX_SLOTS * JSON_OBJECT_SIZE(9) +
+                          JSON_ARRAY_SIZE(HEAP_MAX_TASKS) + HEAP_MAX_TASKS * JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(HEAP_HISTORY_SIZE));
+
+  uint32_t freeNow = heapFree();
+  uint32_t largest = heapLargestBlock();
+  doc["free"] = freeNow;
+  doc["total"] = heapTotal();
+  doc["minFree"] = heapMinFree < freeNow ? heapMinFree : freeNow;
+  doc["largestBlock"] = largest;
+  doc["minLargestBlock"] = heapMinLargestBlock < largest ? heapMinLargestBlock : largest;
+  // 0 when all the free heap is in one block, close to 100 when heavily fragmented
+  doc["fragmentation"] = freeNow ? 100 - (largest * 100) / freeNow : 0;
+  doc["allocs"] = heapAllocs;
+  doc["frees"] = heapFrees;
+  doc["allocBytes"] = heapAllocBytes;
+
+  JsonArray slots = doc.createNestedArray("slots");
+  for (uint8_t i = 0; i < heapSlotCount; i++) {
+    JsonObject s = slots.createNestedObject();
+    s["name"] = heapSlots[i].name;
+    s["calls"] = heapSlots[i].calls;
+    s["grows"] = heapSlots[i].grows;
+    s["last"] = heapSlots[i].lastDelta;
+    s["retained"] = heapSlots[i].retained;
+    s["peak"] = heapSlots[i].peak;
+    s["allocs"] = heapSlots[i].allocs;
+    s["allocBytes"] = heapSlots[i].allocBytes;
+    s["allocPeak"] = heapSlots[i].allocPeak;
+  }
+
+  JsonArray tasks = doc.createNestedArray("tasks");
+  for (uint8_t i = 0; i < heapTaskCount; i++) {
+    JsonObject t = tasks.createNestedObject();
+    t["name"] = (const char*)heapTasks[i].name;
+    t["allocs"] = heapTasks[i].allocs;
+    t["frees"] = heapTasks[i].frees;
+    t["allocBytes"] = heapTasks[i].allocBytes;
+  }
+
+  // Oldest first
+  JsonArray history = doc.createNestedArray("largestBlockHistory");
+  for (uint8_t i = 0; i < heapHistoryCount; i++) {
+    uint8_t idx = (heapHistoryPos + HEAP_HISTORY_SIZE - heapHistoryCount + i) % HEAP_HISTORY_SIZE;
+    history.add(heapHistory[idx]);
+  }
+
+  String out;
+  serializeJson(doc, out);
+  return out;
+}
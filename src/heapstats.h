@@ -0,0 +1,58 @@
+#pragma once
+#include <Arduino.h>
+
+// Number of named accounting slots (handlers, callbacks, push)
+#define HEAP_MAX_SLOTS 24
+// Largest free block history, one sample every HEAP_SAMPLE_INTERVAL_MS
+#define HEAP_HISTORY_SIZE 24
+#define HEAP_SAMPLE_INTERVAL_MS 300000
+// Tasks with their own allocation counters, the others are counted together
+#define HEAP_MAX_TASKS 8
+
+struct HeapSlot {
+  const char* name;
+  uint32_t calls;
+  uint32_t grows;       // calls which returned with less free heap than on entry
+  int32_t lastDelta;    // free heap taken (>0) or given back (<0) by the last call
+  int32_t retained;     // sum of all deltas, a steady increase means a leak
+  uint32_t peak;        // biggest drop of free heap seen inside a call
+  uint32_t allocs;      // malloc() calls inside the calls, counted by the wrappers
+  uint32_t allocBytes;
+  uint32_t allocPeak;   // most bytes allocated and not yet freed inside a call
+};
+
+// malloc() calls made by a task, whatever the scope
+struct HeapTask {
+  void* task;           // TaskHandle_t, nullptr for the allocations before the scheduler and in interrupts
+  char name[16];
+  uint32_t allocs;
+  uint32_t frees;
+  uint32_t allocBytes;
+};
+
+// Account the heap used between construction and destruction to the slot "name".
+// Scopes can be nested, heapTrackSample() refines the peak of the innermost one.
+class HeapScope {
+  public:
+    explicit HeapScope(const char* name);
+    ~HeapScope();
+    void sample(uint32_t freeNow);
+    void account(size_t allocated, size_t released);
+  private:
+    HeapSlot* slot;
+    HeapScope* parent;
+    uint32_t startFree;
+    uint32_t minFree;
+    uint32_t allocs = 0;
+    uint32_t allocBytes = 0;
+    int32_t liveBytes = 0;     // can go below 0 when older blocks are freed
+    int32_t peakLive = 0;
+};
+
+uint32_t heapFree();
+uint32_t heapTotal();
+uint32_t heapLargestBlock();
+
+void heapTrackSample();
+void heapTick();
+String heapReport();
@@ -0,0 +1,216 @@
+#pragma once
+#include <Arduino.h>
+#include <HeatPump.h>
+#include "spscqueue.h"
+
+// Typed view of the heat pump settings, the HeatPump library keeps them as strings.
+// Each enum indexes its name table, the last entry is used for unknown values.
+
+enum HpPower : uint8_t {
+  HP_POWER_OFF,
+  HP_POWER_ON,
+  HP_POWER_UNKNOWN
+};
+
+enum HpMode : uint8_t {
+  HP_MODE_AUTO,
+  HP_MODE_COOL,
+  HP_MODE_DRY,
+  HP_MODE_HEAT,
+  HP_MODE_FAN,
+  HP_MODE_UNKNOWN
+};
+
+enum HpFan : uint8_t {
+  HP_FAN_AUTO,
+  HP_FAN_QUIET,
+  HP_FAN_1,
+  HP_FAN_2,
+  HP_FAN_3,
+  HP_FAN_4,
+  HP_FAN_UNKNOWN
+};
+
+enum HpVane : uint8_t {
+  HP_VANE_AUTO,
+  HP_VANE_SWING,
+  HP_VANE_1,
+  HP_VANE_2,
+  HP_VANE_3,
+  HP_VANE_4,
+  HP_VANE_5,
+  HP_VANE_UNKNOWN
+};
+
+enum HpWideVane : uint8_t {
+  HP_WIDEVANE_SWING,
+  HP_WIDEVANE_1,    // <<
+  HP_WIDEVANE_2,    // <
+  HP_WIDEVANE_3,    // |
+  HP_WIDEVANE_4,    // >
+  HP_WIDEVANE_5,    // >>
+  HP_WIDEVANE_6,    // <>
+  HP_WIDEVANE_UNKNOWN
+};
+
+struct HpStateName {
+  const char* name;         // HeatPump library and web form value, nullptr when unknown
+  int8_t metric;            // value exported on /metrics
+  const char* placeholder;  // option to select on the control page
+};
+
+constexpr HpStateName hpPowerNames[] = {
+  {"OFF", 0, "_POWER_OFF_"},
+  {"ON", 1, "_POWER_ON_"},
+  {nullptr, 0, ""}
+};
+
+constexpr HpStateName hpModeNames[] = {
+  {"AUTO", -1, "_MODE_A_"},
+  {"COOL", 1, "_MODE_C_"},
+  {"DRY", 2, "_MODE_D_"},
+  {"HEAT", 3, "_MODE_H_"},
+  {"FAN", 4, "_MODE_F_"},
+  {nullptr, -2, ""}
+};
+
+constexpr HpStateName hpFanNames[] = {
+  {"AUTO", -1, "_FAN_A_"},
+  {"QUIET", 0, "_FAN_Q_"},
+  {"1", 1, "_FAN_1_"},
+  {"2", 2, "_FAN_2_"},
+  {"3", 3, "_FAN_3_"},
+  {"4", 4, "_FAN_4_"},
+  {nullptr, -2, ""}
+};
+
+constexpr HpStateName hpVaneNames[] = {
+  {"AUTO", -1, "_VANE_A_"},
+  {"SWING", 0, "_VANE_S_"},
+  {"1", 1, "_VANE_1_"},
+  {"2", 2, "_VANE_2_"},
+  {"3", 3, "_VANE_3_"},
+  {"4", 4, "_VANE_4_"},
+  {"5", 5, "_VANE_5_"},
+  {nullptr, -2, ""}
+};
+
+constexpr HpStateName hpWideVaneNames[] = {
+  {"SWING", 0, "_WVANE_S_"},
+  {"<<", 1, "_WVANE_1_"},
+  {"<", 2, "_WVANE_2_"},
+  {"|", 3, "_WVANE_3_"},
+  {">", 4, "_WVANE_4_"},
+  {">>", 5, "_WVANE_5_"},
+  {"<>", 6, "_WVANE_6_"},
+  {nullptr, -2, ""}
+};
+
+static_assert(sizeof(hpPowerNames) / sizeof(HpStateName) == HP_POWER_UNKNOWN + 1, "hpPowerNames out of sync");
+static_assert(sizeof(hpModeNames) / sizeof(HpStateName) == HP_MODE_UNKNOWN + 1, "hpModeNames out of sync");
+static_assert(sizeof(hpFanNames) / sizeof(HpStateName) == HP_FAN_UNKNOWN + 1, "hpFanNames out of sync");
+static_assert(sizeof(hpVaneNames) / sizeof(HpStateName) == HP_VANE_UNKNOWN + 1, "hpVaneNames out of sync");
+static_assert(sizeof(hpWideVaneNames) / sizeof(HpStateName) == HP_WIDEVANE_UNKNOWN + 1, "hpWideVaneNames out of sync");
+
+// Index of "value" in a name table, case insensitive. Tables have at most 8 entries
+// and the first character rejects almost all of them before the string compare.
+template <size_t N>
+uint8_t hpLookup(const HpStateName (&table)[N], const char* value) {
+  if (value == nullptr || value[0] == '\0') return N - 1;
+  char first = toupper(value[0]);
+  for (uint8_t i = 0; i < N - 1; i++) {
+    if (table[i].name[0] == first && strcasecmp(table[i].name, value) == 0) return i;
+  }
+  return N - 1;
+}
+
+inline HpPower hpParsePower(const char* value) { return (HpPower)hpLookup(hpPowerNames, value); }
+inline HpMode hpParseMode(const char* value) { return (HpMode)hpLookup(hpModeNames, value); }
+inline HpFan hpParseFan(const char* value) { return (HpFan)hpLookup(hpFanNames, value); }
+inline HpVane hpParseVane(const char* value) { return (HpVane)hpLookup(hpVaneNames, value); }
+inline HpWideVane hpParseWideVane(const char* value) { return (HpWideVane)hpLookup(hpWideVaneNames, value); }
+
+struct HpState {
+  HpPower power;
+  HpMode mode;
+  HpFan fan;
+  HpVane vane;
+  HpWideVane wideVane;
+  float temperature;        // Celsius
+};
+
+inline HpState hpStateFrom(const heatpumpSettings& settings) {
+  HpState state;
+  state.power = hpParsePower(settings.power);
+  state.mode = hpParseMode(settings.mode);
+  state.fan = hpParseFan(settings.fan);
+  state.vane = hpParseVane(settings.vane);
+  state.wideVane = hpParseWideVane(settings.wideVane);
+  state.temperature = settings.temperature;
+  return state;
+}
+
+// Requests from the web/network side, executed by the CN105 side
+enum HpCommandType : uint8_t {
+  HP_CMD_POWER,             // value is a HpPower
+  HP_CMD_MODE,              // value is a HpMode
+  HP_CMD_FAN,               // value is a HpFan
+  HP_CMD_VANE,              // value is a HpVane
+  HP_CMD_WIDEVANE,          // value is a HpWideVane
+  HP_CMD_TEMPERATURE,       // Celsius
+  HP_CMD_REMOTE_TEMP,       // Celsius, 0 to use the unit sensor
+  HP_CMD_CONNECT,
+  HP_CMD_REFRESH            // push the current settings again
+};
+
+struct HpCommand {
+  HpCommandType type;
+  uint8_t value;
+  float temperature;
+};
+
+#define HP_COMMAND_QUEUE_SIZE 16
+typedef SpscQueue<HpCommand, HP_COMMAND_QUEUE_SIZE> HpCommandQueue;
+
+// Changes reported by the CN105 side, handled in loop()
+#define HP_EVENT_PACKET_SIZE 24
+
+enum HpEventType : uint8_t {
+  HP_EVENT_SETTINGS,
+  HP_EVENT_STATUS,
+  HP_EVENT_PACKET,
+  HP_EVENT_CONNECTED,
+  HP_EVENT_DISCONNECTED,
+  HP_EVENT_COMMAND
+};
+
+struct HpEvent {
+  HpEventType type;
+  HpState settings;                       // HP_EVENT_SETTINGS
+  float roomTemperature;                  // HP_EVENT_STATUS, Celsius
+  int compressorFrequency;
+  bool operating;
+  const char* direction;                  // HP_EVENT_PACKET, static string from the library
+  uint8_t length;
+  uint8_t packet[HP_EVENT_PACKET_SIZE];
+  HpCommand command;                      // HP_EVENT_COMMAND, once sent to the library
+};
+
+// Everything the readers need, published by the CN105 side
+struct HpSnapshot {
+  bool connected;
+  HpState settings;
+  float roomTemperature;                  // Celsius
+  int compressorFrequency;
+  bool operating;
+};
+
+inline bool operator==(const HpState& a, const HpState& b) {
+  return a.power == b.power && a.mode == b.mode && a.fan == b.fan && a.vane == b.vane &&
+         a.wideVane == b.wideVane && a.temperature == b.temperature;
+}
+
+inline bool operator==(const HpSnapshot& a, const HpSnapshot& b) {
+  return a.connected == b.connected && a.settings == b.settings && a.roomTemperature == b.roomTemperature &&
+         a.compressorFrequency == b.compressorFrequency && a.operating == b.operating;
+}
@@ -49,4 +49,25 @@ mitsubishi_operating{hostname="_UNIT_NAME_"} _OPER_
 # HELP mitsubishi_compressor_frequency Heat pump compressor frequency
 # TYPE mitsubishi_compressor_frequency gauge
 mitsubishi_compressor_frequency{hostname="_UNIT_NAME_"} _COMPFREQ_
+# HELP mitsubishi_poll_interval_ms Current CN105 polling interval
+# TYPE mitsubishi_poll_interval_ms gauge
+mitsubishi_poll_interval_ms{hostname="_UNIT_NAME_"} _POLL_INTERVAL_
+# HELP mitsubishi_polls_per_minute CN105 polls during the last minute
+# TYPE mitsubishi_polls_per_minute gauge
+mitsubishi_polls_per_minute{hostname="_UNIT_NAME_"} _POLL_RATE_
+)====";
+
+// Counters of the server itself, rendered for each scrape after the cached part
+const char html_metrics_live[] PROGMEM = R"====(# HELP mitsubishi_http_cache_hits_total Pages served from the response cache
+# TYPE mitsubishi_http_cache_hits_total counter
+mitsubishi_http_cache_hits_total{hostname="_UNIT_NAME_"} _CACHE_HITS_
+# HELP mitsubishi_http_cache_misses_total Pages rendered again
+# TYPE mitsubishi_http_cache_misses_total counter
+mitsubishi_http_cache_misses_total{hostname="_UNIT_NAME_"} _CACHE_MISSES_
+# HELP mitsubishi_http_cache_bytes Memory held by the response cache
+# TYPE mitsubishi_http_cache_bytes gauge
+mitsubishi_http_cache_bytes{hostname="_UNIT_NAME_"} _CACHE_BYTES_
+# HELP mitsubishi_http_rate_limited_total Requests answered with 429
+# TYPE mitsubishi_http_rate_limited_total counter
+mitsubishi_http_rate_limited_total{hostname="_UNIT_NAME_"} _RATE_LIMITED_
 )====";
@@ -28,8 +28,8 @@ const char html_page_reset[] PROGMEM =
 ;
 
 
-const char html_page_save_reboot[] PROGMEM =
-"<p>Saving configuration and rebooting... Refresh in <span id='count'>10s</span>...</p>"
+const char html_page_save[] PROGMEM =
+"<p>Configuration saved and applied. Back in <span id='count'>10s</span>...</p>"
 ;
 
 const char html_page_server[] PROGMEM =
@@ -43,8 +43,50 @@ const char html_page_server[] PROGMEM =
                 "autocomplete='off' autocorrect='off' autocapitalize='off' spellcheck='false' "
                 "placeholder=' ' value='_SERVER_URL_'>"
             "</p>"
+            "<p><b>Push format</b>"
+                "<select name='pf'>"
+                    "<option value='json' _PUSH_JSON_>JSON</option>"
+                    "<option value='msgpack' _PUSH_MSGPACK_>MessagePack</option>"
+                "</select>"
+            "</p>"
+            "<p><b>Multicast group</b> (as 239.1.2.3, empty to disable)"
+                "<br/>"
+                "<input id='mg' name='mg' "
+                "autocomplete='off' autocorrect='off' autocapitalize='off' spellcheck='false' "
+                "placeholder=' ' value='_MCAST_GROUP_'>"
+            "</p>"
+            "<p><b>Multicast port</b>"
+                "<input type='number' id='mgp' name='mgp' min='1' max='65535' value='_MCAST_PORT_'>"
+            "</p>"
+#ifdef USE_MQTT
+            "<p><b>MQTT broker</b> (empty to disable)"
+                "<br/>"
+                "<input id='mh' name='mh' "
+                "autocomplete='off' autocorrect='off' autocapitalize='off' spellcheck='false' "
+                "placeholder=' ' value='_MQTT_SERVER_'>"
+            "</p>"
+            "<p><b>MQTT port</b>"
+                "<input type='number' id='mp' name='mp' min='1' max='65535' value='_MQTT_PORT_'>"
+            "</p>"
+            "<p><b>MQTT user</b>"
+                "<br/>"
+                "<input id='mu' name='mu' "
+                "autocomplete='off' autocorrect='off' autocapitalize='off' spellcheck='false' "
+                "placeholder=' ' value='_MQTT_USER_'>"
+            "</p>"
+            "<p><b>MQTT password</b>"
+                "<br/>"
+                "<input id='mpw' type='password' name='mpw' placeholder=' ' value='_MQTT_PWD_'>"
+            "</p>"
+            "<p><b>MQTT topic prefix</b>"
+                "<br/>"
+                "<input id='mt' name='mt' "
+                "autocomplete='off' autocorrect='off' autocapitalize='off' spellcheck='false' "
+                "placeholder=' ' value='_MQTT_TOPIC_'>"
+            "</p>"
+#endif
             "<br/>"
-            "<button name='save' type='submit' class='button bgrn'>Save & Reboot</button>"
+            "<button name='save' type='submit' class='button bgrn'>Save</button>"
         "</form>"
     "</fieldset>"
     "<p>"
@@ -70,8 +112,14 @@ const char html_page_others[] PROGMEM =
                     "<option value='OFF' _DEBUG_PCKTS_OFF_>Off</option>"
                 "</select>"
             "</p>"
+            "<p><b>HVAC polling, after a command (ms)</b>"
+                "<input type='number' name='PollFast' min='100' max='8000' value='_POLL_FAST_'>"
+            "</p>"
+            "<p><b>HVAC polling, when idle (ms)</b>"
+                "<input type='number' name='PollSlow' min='100' max='8000' value='_POLL_SLOW_'>"
+            "</p>"
             "<br/>"
-            "<button name='save' type='submit' class='button bgrn'>Save & Reboot</button>"
+            "<button name='save' type='submit' class='button bgrn'>Save</button>"
         "</form>"
     "</fieldset>"
     "<p>"
@@ -91,10 +139,21 @@ const char html_page_status[] PROGMEM =
      "<p><b>HVAC Connection Retries</b>"
         " ==> "
         "_HVAC_RETRIES_"
+    "</p>"
+     "<p><b>HVAC Polling</b>"
+        " ==> "
+        "_HVAC_POLL_"
+    "</p>"
+     "<p><b>Event subscribers</b>"
+        "_EVENT_BUS_"
     "</p>"
      "<p><b>WIFI RSSI</b>"
         " ==> "
         "_WIFI_STATUS_ dBm"
+    "</p>"
+     "<p><b>WIFI connection time</b>"
+        " ==> "
+        "_WIFI_CONNECT_TIME_"
     "</p>"
      "<p><b>Free Heap</b>"
         " ==> "
@@ -107,6 +166,9 @@ const char html_page_status[] PROGMEM =
      "<p><b>Boot time</b>"
         " ==> "
         "_BOOT_TIME_"
+    "</p>"
+     "<p><b>Boot timeline</b>"
+        "_BOOT_TIMELINE_"
     "</p>"
     "</fieldset>"
     "<br />"
@@ -137,6 +199,27 @@ const char html_page_wifi[] PROGMEM =
                 "<br/>"
                 "<input id='psk' type='password' name='psk' placeholder=' ' value='_PSK_'>"
             "</p>"
+            "<p><b>Other networks</b> (used when the first one is not available)"
+                "<br/>"
+                "<input id='ssid2' "
+                "autocomplete='off' autocorrect='off' autocapitalize='off' spellcheck='false' "
+                "name='ssid2' placeholder='SSID 2' value='_SSID2_'>"
+                "<input id='psk2' type='password' name='psk2' placeholder='PSK 2' value='_PSK2_'>"
+                "<input id='ssid3' "
+                "autocomplete='off' autocorrect='off' autocapitalize='off' spellcheck='false' "
+                "name='ssid3' placeholder='SSID 3' value='_SSID3_'>"
+                "<input id='psk3' type='password' name='psk3' placeholder='PSK 3' value='_PSK3_'>"
+                "<input id='ssid4' "
+                "autocomplete='off' autocorrect='off' autocapitalize='off' spellcheck='false' "
+                "name='ssid4' placeholder='SSID 4' value='_SSID4_'>"
+                "<input id='psk4' type='password' name='psk4' placeholder='PSK 4' value='_PSK4_'>"
+            "</p>"
+            "<p><b>Roaming</b> (move to a stronger access point)"
+                "<select name='roam'>"
+                    "<option value='ON' _ROAM_ON_>On</option>"
+                    "<option value='OFF' _ROAM_OFF_>Off</option>"
+                "</select>"
+            "</p>"
             "<p><b>OTA Password</b>"
                 "<br/>"
                 "<input id='otapwd' "
@@ -144,7 +227,7 @@ const char html_page_wifi[] PROGMEM =
                 "name='otapwd' placeholder=' ' value='_OTA_PWD_'>"
             "</p>"
             "<br/>"
-            "<button name='save' type='submit' class='button bgrn'>Save & Reboot</button>"
+            "<button name='save' type='submit' class='button bgrn'>Save</button>"
         "</form>"
     "</fieldset>"
     "<p>"
@@ -295,7 +378,7 @@ const char html_page_unit[] PROGMEM =
                 "<input id='lpw' name='lpw' type='password' placeholder=' ' value='_LOGIN_PASSWORD_'>"
             "</p>"
             "<br/>"
-            "<button name='save' type='submit' class='button bgrn'>Save & Reboot</button>"
+            "<button name='save' type='submit' class='button bgrn'>Save</button>"
         "</form>"
     "</fieldset>"
     "<p>"
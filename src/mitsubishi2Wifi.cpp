@@ -20,23 +20,36 @@
 
 #include "mitsubishi2Wifi.h"
 #include "util.h"
+#include "heapstats.h"
+#include "fixedstring.h"
+#include "configstore.h"
+#include "hpstate.h"
+#include "spscqueue.h"
+#include "seqlock.h"
+#include "eventbus.h"
+#include "responsecache.h"
+#include "ratelimit.h"
+#include "temperature.h"
 
 #include "FS.h"               // SPIFFS for store config
 #ifdef ESP32
 #include <WiFi.h>             // WIFI for ESP32
 #include <WiFiUdp.h>
 #include <ESPmDNS.h>          // mDNS for ESP32
-#include <WebServer.h>        // webServer for ESP32
+#include <AsyncTCP.h>
 #include <HTTPClient.h>
-WebServer server(80);         //ESP32 web
+#include <Update.h>
 #else
 #include <ESP8266WiFi.h>      // WIFI for ESP8266
 #include <WiFiClient.h>
+#include <WiFiUdp.h>
 #include <ESP8266mDNS.h>      // mDNS for ESP8266
-#include <ESP8266WebServer.h> // webServer for ESP8266
+#include <ESPAsyncTCP.h>
 #include <ESP8266HTTPClient.h> // webClient for ESP8266
-ESP8266WebServer server(80);  // ESP8266 web
+#include <Updater.h>
 #endif
+#include <ESPAsyncWebServer.h> // event driven webServer, handlers run in the network task
+AsyncWebServer server(80);
 
 //Because SPIFFS is obsolette
 #if 0
@@ -49,9 +62,12 @@ ESP8266WebServer server(80);  // ESP8266 web
 #include <ArduinoJson.h>      // json to process MQTT: ArduinoJson 6.11.4
 #include <DNSServer.h>        // DNS for captive portal
 #include <math.h>             // for rounding to Fahrenheit values
-#include <map>
 #include <cmath>              // For roundf function
 
+#ifdef USE_MQTT
+#include <AsyncMqttClient.h>  // optional MQTT sink
+#endif
+
 #include <ArduinoOTA.h>   // for OTA
 //#include <Ticker.h>     // for LED status (Using a Wemos D1-Mini)
 //void tick(); // led blink tick
@@ -76,15 +92,112 @@ DNSServer dnsServer;
 
 boolean captive = false;
 boolean wifi_config = false;
+boolean otaStarted = false;
+boolean serialLogs = true;
+
+//Wifi connection state, see wifiLoop()
+enum WifiState : uint8_t {
+  WIFI_STATE_OFF,
+  WIFI_STATE_SCANNING,
+  WIFI_STATE_CONNECTING,
+  WIFI_STATE_CONNECTED,
+  WIFI_STATE_ROAMING,
+  WIFI_STATE_WAIT_RETRY
+};
+WifiState wifiState = WIFI_STATE_OFF;
+unsigned long wifiStateSince;
+unsigned int wifiRetries;
+boolean wifiFallbackAP = false;
+boolean wifiFastConnect = false;
+unsigned long wifiAttemptStart;
+unsigned long wifiConnectDuration;
+boolean wifiConnectWasFast = false;
+uint8_t wifiCurrent = 0;
+unsigned long wifiRoamCheck;
+unsigned long wifiRestartAt = 0;
+unsigned long rebootAt = 0;
+bool rebootFormat = false;            // erase the settings before the reboot
+
+// Incremented each time the settings change
+uint32_t configVersion = 0;
+// Incremented only when the MQTT settings change, the session is kept otherwise
+uint32_t mqttSettingsVersion = 0;
+bool otaRestart = false;              // hostname or OTA password changed, applied from loop()
+#ifdef ESP32
+// Pages change the settings from the network task, loop() changes the wifi history and the subscriptions
+SemaphoreHandle_t configLock;
+#endif
+
+// Held while settings globals are changed and while they are copied to the record,
+// so a save never sees a half updated configuration. Can be nested, saveConfig() takes it too.
+class ConfigGuard {
+  public:
+    ConfigGuard() {
+#ifdef ESP32
+      xSemaphoreTakeRecursive(configLock, portMAX_DELAY);
+#endif
+    }
+    ~ConfigGuard() {
+#ifdef ESP32
+      xSemaphoreGiveRecursive(configLock);
+#endif
+    }
+};
 boolean remoteTempActive = false;
 
 //HVAC
 HeatPump hp;
-unsigned long lastTempSend;
+unsigned long lastTempSend;             // push side throttle of the room temperature
 unsigned long lastHpSync;
 unsigned int hpConnectionRetries;
 unsigned int hpConnectionTotalRetries;
+unsigned long lastHpPoll;
+unsigned long hpActivityAt;           // last command echo or compressor change
+int hpLastCompressorFrequency = -1;
+uint16_t hpPollInterval;
+uint16_t hpPollCount;
+uint16_t hpPollRate;                  // polls during the last minute
+unsigned long hpPollRateSince;
+
+// The CN105 side (hp.sync() and the library callbacks) only talks to the rest through these
+// queues. On dual core ESP32 it runs in its own task, pinned away from loop().
+#if defined(ESP32) && !CONFIG_FREERTOS_UNICORE
+#define HP_TASK
+TaskHandle_t hpTaskHandle;
+#endif
+HpCommandQueue hpCommands;                               // loop() -> CN105
+HpCommandQueue webCommands;                              // web server task -> CN105
+SpscQueue<float, 4> webRemoteTemps;                      // /json readings -> loop()
+HpEventBus hpBus;                                        // CN105 -> subscribers in loop()
+SeqLock<HpSnapshot> hpSnapshot;                          // CN105 -> any reader
+ResponseCache responseCache;                             // network task only
+RateLimiter rateLimiter;                                 // network task only
+HpSnapshot hpPublished;                                  // CN105 side copy of the last snapshot
+bool hpWasConnected = false;
+
+#ifdef USE_MQTT
+AsyncMqttClient mqttClient;
+HpCommandQueue mqttCommands;                             // MQTT network task -> CN105
+FixedString<128> mqttStateTopic;
+FixedString<128> mqttSetTopic;
+FixedString<128> mqttAvailabilityTopic;
+volatile bool mqttConnecting = false;
+volatile bool mqttDirty = false;
+volatile uint32_t mqttPublishedVersion = 0xFFFFFFFF;
+unsigned long mqttLastAttempt;
+unsigned long mqttLastPublish;
+uint32_t mqttConfigVersion;
+#endif
 unsigned long lastRemoteTemp;
+float remoteTempFiltered;             // smoothed external reading, Celsius
+float remoteTempSent = NAN;           // last value forwarded to the unit
+unsigned long remoteTempSentAt;
+WiFiUDP remoteTempUdp;
+WiFiUDP mcastUdp;
+uint32_t mcastSequence = 0;
+uint32_t mcastSentVersion = 0xFFFFFFFF;
+unsigned long mcastLastSend;
+bool mcastDirty = false;
 
 //Local state
 StaticJsonDocument<JSON_OBJECT_SIZE(12)> rootInfo;
@@ -100,7 +213,19 @@ String LogString;
 
 const char compile_date[] = __DATE__ " " __TIME__;
 
+// Register a route, with heap accounting under its uri
+void onTracked(const char* uri, HttpHandler handler, ArBodyHandlerFunction body = nullptr) {
+  server.on(uri, HTTP_ANY, [uri, handler](AsyncWebServerRequest* request) {
+    HeapScope scope(uri);
+    handler(request);
+    bootMark(BOOT_FIRST_PAGE);
+  }, nullptr, body);
+}
+
 void setup() {
+#ifdef ESP32
+  configLock = xSemaphoreCreateRecursiveMutex();
+#endif
   // Start serial for debug before HVAC connect to serial
   Serial.begin(115200);
 
@@ -118,6 +243,7 @@ void setup() {
     if (SPIFFS.begin())
       write_log(F("Mounted file system after formating"));
   }
+  bootMark(BOOT_FS);
 
   //set led pin as output
   pinMode(blueLedPin, OUTPUT);
@@ -129,31 +255,24 @@ void setup() {
   hostname += getId();
 
   setWIFIDefaults();
-  wifi_config_exists = loadWifi();
+  if (!loadConfig())
+  {
+    write_log(F("No binary config, looking for json files"));
+    migrateConfig();
+  }
 
 //Workaround for not working device in Access point
 #if defined(WIFIPASSWORD) && defined(WIFISSID)
     write_log(F("Force SSID and Password."));
     saveWifi(WIFISSID,WIFIPASSWORD,"ForcedHVAC","");
-    wifi_config_exists = loadWifi();
 #endif
 
+  wifi_config_exists = !ap_ssid.isEmpty();
   if (!wifi_config_exists)
   {
     write_log(F("Can't load Wifi settings"));
   }
-  if (!loadOthers())
-  {
-    write_log(F("Can't load Others settings"));
-  }
-  if (!loadUnit())
-  {
-    write_log(F("Can't load Unit settings"));
-  }
-  if (!loadServerSettings())
-  {
-    write_log(F("Can't load server settings"));
-  }
+  bootMark(BOOT_CONFIG);
 
 #ifdef ESP32
   WiFi.setHostname(hostname.c_str());
@@ -168,32 +287,29 @@ void setup() {
       SPIFFS.remove(console_file);
     }
 
-    //Web interface
-    if (login_password.length() > 0)
-    {
-      server.on("/login", handleLogin);
-      //here the list of headers to be recorded, use for authentication
-      const char * headerkeys[] = {"User-Agent", "Cookie"} ;
-      size_t headerkeyssize = sizeof(headerkeys) / sizeof(char*);
-      //ask server to track these headers
-      server.collectHeaders(headerkeys, headerkeyssize);
-    }
-    server.on("/", handleRoot);
-    server.on("/control", handleControl);
-    server.on("/setup", handleSetup);
-    server.on("/server", handleServer);
-    server.on("/wifi", handleWifi);
-    server.on("/unit", handleUnit);
-    server.on("/status", handleStatus);
-    server.on("/others", handleOthers);
-    server.on("/metrics", handleMetrics);
-    server.on("/upgrade", handleUpgrade);
-    server.on("/logs", handleLogs);
-    server.on("/json", handleJson);
+    //Web interface, the login is always there as the password can be set at runtime
+    onTracked("/login", handleLogin);
+    onTracked("/", handleRoot);
+    onTracked("/control", handleControl);
+    onTracked("/setup", handleSetup);
+    onTracked("/server", handleServer);
+    onTracked("/wifi", handleWifi);
+    onTracked("/unit", handleUnit);
+    onTracked("/status", handleStatus);
+    onTracked("/others", handleOthers);
+    onTracked("/metrics", handleMetrics);
+    onTracked("/upgrade", handleUpgrade);
+    onTracked("/logs", handleLogs);
+    onTracked("/json", handleJson, handleJsonBody);
+    onTracked("/subscriptions", handleSubscriptions, handleJsonBody);
+    server.on("/debug/heap", handleDebugHeap);
+    onTracked("/config", handleConfigExport);
     server.on("/upload", HTTP_POST, handleUploadDone, handleUploadLoop);
     server.onNotFound(handleNotFound);
 
     server.begin();
+    bootMark(BOOT_SERVER);
+    remoteTempUdp.begin(REMOTE_TEMP_UDP_PORT);
 
     lastHpSync = 0;
     hpConnectionRetries = 0;
@@ -201,7 +317,18 @@ void setup() {
 
     write_log(F("Connection to HVAC. Stop serial log."));
     write_log(F("\n\n\n"));
-    delay(1000);
+    // The HVAC take the UART, wait for the log to be sent
+    Serial.flush();
+    serialLogs = false;
+
+    hpBus.subscribe("push", HP_EVENT_MASK(HP_EVENT_SETTINGS) | HP_EVENT_MASK(HP_EVENT_STATUS) |
+                    HP_EVENT_MASK(HP_EVENT_PACKET), hpPushEvent);
+#ifdef USE_MQTT
+    mqttInit();
+#endif
+    hpBus.subscribe("multicast", HP_EVENT_MASK(HP_EVENT_SETTINGS) | HP_EVENT_MASK(HP_EVENT_STATUS) |
+                    HP_EVENT_MASK(HP_EVENT_CONNECTED) | HP_EVENT_MASK(HP_EVENT_DISCONNECTED), mcastEvent);
+    hpBus.subscribe("subscriptions", HP_EVENT_MASK(HP_EVENT_SETTINGS) | HP_EVENT_MASK(HP_EVENT_STATUS), subEvent);
 
     // Used for Auto Update
     hp.setSettingsChangedCallback(hpSettingsChanged); // Called when Settings are changed
@@ -224,10 +351,15 @@ void setup() {
 #else
     hp.connect(&Serial);
 #endif
+    bootMark(BOOT_HP_CONNECT);
     // Get default values.
     hpSettingsChanged();
     hpStatusChanged(hp.getStatus());
 
+#ifdef HP_TASK
+    xTaskCreatePinnedToCore(hpTask, "cn105", HP_TASK_STACK_SIZE, nullptr, HP_TASK_PRIORITY, &hpTaskHandle, HP_TASK_CORE);
+#endif
+
   }
   else
   {
@@ -237,9 +369,10 @@ void setup() {
     server.onNotFound(handleNotFound);
     server.begin();
     captive = true;
-  }
 
-  initOTA();
+    initOTA();
+    otaStarted = true;
+  }
 
 }
 
@@ -250,15 +383,30 @@ void tick()
   digitalWrite(blueLedPin, !state);    // set pin to the opposite state
 }
 
+#define PUSH_MSGPACK_SIZE 256
+
 bool SendJson(const JsonVariant j) {
+  HeapScope scope("push");
   String s; // LEAK ?
-  serializeJson(j, s);
+  uint8_t packed[PUSH_MSGPACK_SIZE];
+  size_t packedLength = 0;
+  bool msgpack = server_msgpack;
+  if (msgpack) {
+    // serializeMsgPack() stops at the end of the buffer, a truncated message would still be sent
+    packedLength = serializeMsgPack(j, packed, sizeof(packed));
+    if (packedLength != measureMsgPack(j)) {
+      write_log(String(F("Push too big for MessagePack (")) + measureMsgPack(j) + F(" bytes), sent as JSON"));
+      msgpack = false;
+    }
+  }
+  if (!msgpack) serializeJson(j, s);
+  heapTrackSample();
 
   http.setTimeout(2000);
   http.begin(espClient, server_url.c_str());
-  http.addHeader("Content-Type", "application/json");
+  http.addHeader("Content-Type", msgpack ? "application/msgpack" : "application/json");
   //http.addHeader("Accept-Encoding", "identity");
-  int httpResponseCode = http.POST(s);
+  int httpResponseCode = msgpack ? http.POST(packed, packedLength) : http.POST(s);
 
   //http.beginRequest();
   //http.post("/");
@@ -276,6 +424,176 @@ bool SendJson(const JsonVariant j) {
   return true;
 }
 
+void configToRecord(ConfigRecord& rec) {
+  rec.hostname = hostname.c_str();
+  rec.ap_ssid = ap_ssid.c_str();
+  rec.ap_pwd = ap_pwd.c_str();
+  rec.ota_pwd = ota_pwd.c_str();
+  rec.server_url = server_url.c_str();
+  rec.login_password = login_password.c_str();
+  rec.temp_step = temp_step.c_str();
+  rec.min_temp = min_temp;
+  rec.max_temp = max_temp;
+  rec.useFahrenheit = useFahrenheit;
+  rec.supportHeatMode = supportHeatMode;
+  rec.debugModePckts = _debugModePckts;
+  rec.debugModeLogs = _debugModeLogs;
+  memcpy(rec.wifi_bssid, wifi_bssid, sizeof(wifi_bssid));
+  rec.wifi_channel = wifi_channel;
+  for (uint8_t i = 0; i < WIFI_MAX_NETWORKS - 1; i++) {
+    rec.wifi_ssid[i] = wifi_ssid[i].c_str();
+    rec.wifi_pwd[i] = wifi_pwd[i].c_str();
+  }
+  memcpy(rec.wifi_history, wifi_history, sizeof(wifi_history));
+  rec.wifi_network = wifi_network;
+  rec.wifi_roaming = wifi_roaming;
+  rec.hp_poll_fast_ms = hp_poll_fast_ms;
+  rec.hp_poll_slow_ms = hp_poll_slow_ms;
+  rec.mqtt_server = mqtt_server.c_str();
+  rec.mqtt_port = mqtt_port;
+  rec.mqtt_user = mqtt_user.c_str();
+  rec.mqtt_pwd = mqtt_pwd.c_str();
+  rec.mqtt_topic = mqtt_topic.c_str();
+  rec.mcast_group = mcast_group;
+  rec.mcast_port = mcast_port;
+  rec.server_msgpack = server_msgpack;
+  for (uint8_t i = 0; i < SUBSCRIPTION_MAX; i++) {
+    rec.subscriptions[i] = subscriptions[i];
+  }
+}
+
+void configFromRecord(const ConfigRecord& rec) {
+  hostname = rec.hostname.c_str();
+  ap_ssid = rec.ap_ssid.c_str();
+  ap_pwd = rec.ap_pwd.c_str();
+  ota_pwd = rec.ota_pwd.c_str();
+  server_url = rec.server_url.c_str();
+  login_password = rec.login_password.c_str();
+  temp_step = rec.temp_step.c_str();
+  min_temp = rec.min_temp;
+  max_temp = rec.max_temp;
+  useFahrenheit = rec.useFahrenheit;
+  supportHeatMode = rec.supportHeatMode;
+  _debugModePckts = rec.debugModePckts;
+  _debugModeLogs = rec.debugModeLogs;
+  memcpy(wifi_bssid, rec.wifi_bssid, sizeof(wifi_bssid));
+  wifi_channel = rec.wifi_channel;
+  for (uint8_t i = 0; i < WIFI_MAX_NETWORKS - 1; i++) {
+    wifi_ssid[i] = rec.wifi_ssid[i].c_str();
+    wifi_pwd[i] = rec.wifi_pwd[i].c_str();
+  }
+  memcpy(wifi_history, rec.wifi_history, sizeof(wifi_history));
+  wifi_network = rec.wifi_network;
+  wifi_roaming = rec.wifi_roaming;
+  hp_poll_fast_ms = rec.hp_poll_fast_ms;
+  hp_poll_slow_ms = rec.hp_poll_slow_ms;
+  mqtt_server = rec.mqtt_server.c_str();
+  mqtt_port = rec.mqtt_port;
+  mqtt_user = rec.mqtt_user.c_str();
+  mqtt_pwd = rec.mqtt_pwd.c_str();
+  mqtt_topic = rec.mqtt_topic.c_str();
+  mcast_group = rec.mcast_group;
+  mcast_port = rec.mcast_port;
+  server_msgpack = rec.server_msgpack;
+  for (uint8_t i = 0; i < SUBSCRIPTION_MAX; i++) {
+    subscriptions[i] = rec.subscriptions[i];
+  }
+}
+
+// Load the whole configuration with a single read
+bool loadConfig() {
+  if (!SPIFFS.exists(config_blob)) {
+    return false;
+  }
+  File configFile = SPIFFS.open(config_blob, "r");
+  if (!configFile) {
+    return false;
+  }
+
+  ConfigRecord rec;
+  size_t size = configFile.size();
+  bool sizeOk = size >= CONFIG_HEADER_SIZE && size <= sizeof(ConfigRecord) &&
+                configFile.read((uint8_t*)&rec, size) == size;
+  configFile.close();
+  if (!sizeOk) {
+    write_log(F("Config blob has a wrong size"));
+    return false;
+  }
+
+  if (rec.magic != CONFIG_MAGIC || rec.version > CONFIG_VERSION || rec.size != size ||
+      rec.crc != getCrc32((const uint8_t*)&rec + CONFIG_HEADER_SIZE, size - CONFIG_HEADER_SIZE)) {
+    write_log(F("Config blob is corrupted"));
+    return false;
+  }
+
+  // Fields added by a later version can overlap the padding of an older record
+  if (rec.version < 2) rec.wifi_channel = 0;
+  ConfigRecord defaults;
+  if (rec.version < 4) {
+    rec.hp_poll_fast_ms = defaults.hp_poll_fast_ms;
+    rec.hp_poll_slow_ms = defaults.hp_poll_slow_ms;
+  }
+  if (rec.version < 5) {
+    rec.mqtt_server = defaults.mqtt_server;
+    rec.mqtt_port = defaults.mqtt_port;
+    rec.mqtt_user = defaults.mqtt_user;
+    rec.mqtt_pwd = defaults.mqtt_pwd;
+    rec.mqtt_topic = defaults.mqtt_topic;
+  }
+  if (rec.version < 6) {
+    rec.mcast_group = defaults.mcast_group;
+    rec.mcast_port = defaults.mcast_port;
+  }
+  if (rec.version < 7) {
+    rec.server_msgpack = defaults.server_msgpack;
+  }
+  if (rec.version < 8) {
+    for (uint8_t i = 0; i < SUBSCRIPTION_MAX; i++) {
+      rec.subscriptions[i] = defaults.subscriptions[i];
+    }
+  }
+
+  configFromRecord(rec);
+  return true;
+}
+
+bool saveConfig() {
+  ConfigGuard guard;
+  ConfigRecord rec;
+  configToRecord(rec);
+  rec.crc = getCrc32((const uint8_t*)&rec + CONFIG_HEADER_SIZE, sizeof(ConfigRecord) - CONFIG_HEADER_SIZE);
+
+  File configFile = SPIFFS.open(config_blob, "w");
+  bool opened = configFile;
+  size_t written = 0;
+  if (opened) {
+    written = configFile.write((const uint8_t*)&rec, sizeof(ConfigRecord));
+    configFile.close();
+  }
+  if (!opened) {
+    write_log(F("Failed to open config blob for writing"));
+    return false;
+  }
+
+  return written == sizeof(ConfigRecord);
+}
+
+// Import the json files used by older firmwares, then drop them
+void migrateConfig() {
+  bool found = loadWifi();
+  found = loadOthers() || found;
+  found = loadUnit() || found;
+  found = loadServerSettings() || found;
+
+  if (!found || !saveConfig()) return;
+
+  write_log(F("Json settings migrated"));
+  SPIFFS.remove(wifi_conf);
+  SPIFFS.remove(others_conf);
+  SPIFFS.remove(unit_conf);
+  SPIFFS.remove(server_conf);
+}
+
 bool loadWifi() {
 
   ap_ssid = "";
@@ -319,15 +637,10 @@ bool loadWifi() {
 
   //write_log(doc.as<String>());
 
-  hostname = doc["hostname"].as<String>();
-  ap_ssid  = doc["ap_ssid"].as<String>();
-  ap_pwd   = doc["ap_pwd"].as<String>();
-  //prevent ota password is "null" if not exist key
-  if (doc.containsKey("ota_pwd")) {
-    ota_pwd  = doc["ota_pwd"].as<String>();
-  } else {
-    ota_pwd = "";
-  }
+  if (doc.containsKey("hostname")) hostname = doc["hostname"].as<const char*>();
+  ap_ssid  = doc["ap_ssid"].as<const char*>();
+  ap_pwd   = doc["ap_pwd"].as<const char*>();
+  ota_pwd  = doc["ota_pwd"].as<const char*>();
 
   return true;
 }
@@ -356,7 +669,7 @@ bool loadServerSettings() {
   DynamicJsonDocument doc(capacity);
   deserializeJson(doc, buf.get());
 
-  server_url          = doc["server_url"].as<String>();
+  server_url          = doc["server_url"].as<const char*>();
 
   return true;
 }
@@ -386,16 +699,11 @@ bool loadUnit() {
   if (unit_tempUnit == "fah") useFahrenheit = true;
   min_temp              = doc["min_temp"].as<uint8_t>();
   max_temp              = doc["max_temp"].as<uint8_t>();
-  temp_step             = doc["temp_step"].as<String>();
+  temp_step             = doc["temp_step"] | "1";
   //mode
   String supportMode = doc["support_mode"].as<String>();
   if (supportMode == "nht") supportHeatMode = false;
-  //prevent login password is "null" if not exist key
-  if (doc.containsKey("login_password")) {
-    login_password = doc["login_password"].as<String>();
-  } else {
-    login_password = "";
-  }
+  login_password = doc["login_password"].as<const char*>();
   return true;
 }
 
@@ -438,93 +746,61 @@ bool loadOthers() {
 
 void saveServerSettings(String ip, String url, String server_port) {
 
-  const size_t capacity = JSON_OBJECT_SIZE(6) + 400;
-  DynamicJsonDocument doc(capacity);
-
   if (url[0] == '\0') url = "http://192.168.1.1:81/";
 
-  doc["server_url"] = url;
+  server_url = url;
 
-  File configFile = SPIFFS.open(server_conf, "w");
-  if (!configFile) {
-    write_log(F("Failed to open config file for writing"));
-    return;
+  if (saveConfig())
+  {
+    write_log(F("Settings saved"));
   }
-  serializeJson(doc, configFile);
-  configFile.close();
-
-  write_log(F("Settings saved"));
 }
 
 void saveUnit(String tempUnit, String supportMode, String loginPassword, String minTemp, String maxTemp, String tempStep) {
-  const size_t capacity = JSON_OBJECT_SIZE(6) + 200;
-  DynamicJsonDocument doc(capacity);
   // if temp unit is empty, we use default celcius
-  if (tempUnit.isEmpty()) tempUnit = "cel";
-  doc["unit_tempUnit"]   = tempUnit;
+  useFahrenheit = (tempUnit == "fah");
   // if minTemp is empty, we use default 16
-  if (minTemp.isEmpty()) minTemp = 16;
-  doc["min_temp"]   = minTemp;
+  min_temp = minTemp.isEmpty() ? 16 : minTemp.toInt();
   // if maxTemp is empty, we use default 31
-  if (maxTemp.isEmpty()) maxTemp = 31;
-  doc["max_temp"]   = maxTemp;
+  max_temp = maxTemp.isEmpty() ? 31 : maxTemp.toInt();
   // if tempStep is empty, we use default 1
-  if (tempStep.isEmpty()) tempStep = 1;
-  doc["temp_step"] = tempStep;
+  temp_step = tempStep.isEmpty() ? "1" : tempStep.c_str();
   // if support mode is empty, we use default all mode
-  if (supportMode.isEmpty()) supportMode = "all";
-  doc["support_mode"]   = supportMode;
-  // if login password is empty, we use empty
-  if (loginPassword.isEmpty()) loginPassword = "";
+  supportHeatMode = (supportMode != "nht");
+  login_password = loginPassword;
 
-  doc["login_password"]   = loginPassword;
-  File configFile = SPIFFS.open(unit_conf, "w");
-  if (!configFile) {
-    // write_log(F("Failed to open config file for writing"));
-  }
-  serializeJson(doc, configFile);
-  configFile.close();
+  saveConfig();
 }
 
-void saveWifi(String apSsid, String apPwd, String hostName, String otaPwd) {
-  const size_t capacity = JSON_OBJECT_SIZE(4) + 130;
-  DynamicJsonDocument doc(capacity);
-  doc["ap_ssid"] = apSsid;
-  doc["ap_pwd"] = apPwd;
-  doc["hostname"] = hostName;
-  doc["ota_pwd"] = otaPwd;
-  File configFile = SPIFFS.open(wifi_conf, "w");
-  if (!configFile) {
-    // write_log(F("Failed to open wifi file for writing"));
-  }
-  serializeJson(doc, configFile);
-  delay(10);
-  configFile.close();
+void saveWifi(const String& apSsid, const String& apPwd, const String& hostName, const String& otaPwd) {
+  ap_ssid = apSsid;
+  ap_pwd = apPwd;
+  hostname = hostName;
+  ota_pwd = otaPwd;
+
+  saveConfig();
 }
 
-void saveOthers(String haa, String haat, String debugPckts, String debugLogs) {
-  const size_t capacity = JSON_OBJECT_SIZE(4) + 130;
-  DynamicJsonDocument doc(capacity);
-  doc["haa"] = haa;
-  doc["haat"] = haat;
-  doc["debugPckts"] = debugPckts;
-  doc["debugLogs"] = debugLogs;
-  File configFile = SPIFFS.open(others_conf, "w");
-  if (!configFile) {
-    // write_log(F("Failed to open wifi file for writing"));
+void saveOthers(const String& haa, const String& haat, const String& debugPckts, const String& debugLogs,
+                const String& pollFast, const String& pollSlow) {
+  _debugModePckts = (debugPckts == "ON");
+  _debugModeLogs = (debugLogs == "ON");
+  if (pollFast.length() > 0) {
+    hp_poll_fast_ms = constrain(pollFast.toInt(), (long)HP_POLL_MIN_MS, (long)HP_POLL_MAX_MS);
   }
-  serializeJson(doc, configFile);
-  delay(10);
-  configFile.close();
+  if (pollSlow.length() > 0) {
+    hp_poll_slow_ms = constrain(pollSlow.toInt(), (long)hp_poll_fast_ms, (long)HP_POLL_MAX_MS);
+  }
+
+  saveConfig();
 }
 
 // Enable OTA only when connected as a client.
 void initOTA() {
   //write_log("Start OTA Listener");
   ArduinoOTA.setHostname(hostname.c_str());
-  if (ota_pwd.length() > 0) {
-    ArduinoOTA.setPassword(ota_pwd.c_str());
-  }
+  // An empty password turns the authentication off, also when it was set before
+  ArduinoOTA.setPassword(ota_pwd.c_str());
   ArduinoOTA.onStart([]() {
     //write_log("Start");
   });
@@ -551,46 +827,18 @@ void setWIFIDefaults() {
 }
 
 bool initWifi() {
-  bool connectWifiSuccess = true;
-
-  //If we have connection setting
-  if (ap_ssid[0] != '\0')
+  //If we have connection setting, the connection is done in background by wifiLoop()
+  if (!ap_ssid.isEmpty())
   {
-    connectWifiSuccess = wifi_config = connectWifi();
-    if (connectWifiSuccess) {
-      return true;
-    }
-    else
-    {
-      // reset hostname back to default before starting AP mode for privacy
-      hostname = hostnamePrefix;
-      hostname += getId();
-    }
+    wifi_config = true;
+    wifiBegin();
+    return true;
   }
 
   // write_log(F("\n\r \n\rStarting in AP mode"));
   WiFi.mode(WIFI_AP);
-  wifi_timeout = millis() + WIFI_RETRY_INTERVAL_MS;
-#ifdef ESP32
-  WiFi.persistent(false); // fix crash esp32 https://github.com/espressif/arduino-esp32/issues/2025
-#endif
-
-  if (!connectWifiSuccess and login_password != "")
-  {
-    // Set AP password when falling back to AP on fail
-    WiFi.softAP(hostname.c_str(), login_password.c_str());
-  }
-  else {
-    // First time setup does not require password
-    WiFi.softAP(hostname.c_str());
-  }
-
-  delay(2000); // VERY IMPORTANT
-  WiFi.softAPConfig(apIP, apIP, netMsk);
-  delay(2000); // VERY IMPORTANT
-
-  //write_log(F("IP address: "));
-  //Serial.println(WiFi.softAPIP());
+  // First time setup does not require password
+  startSoftAP(nullptr);
 
   //ticker.attach(0.2, tick); // Start LED to flash rapidly to indicate we are ready for setting up the wifi-connection (entered captive portal).
   wifi_config = false;
@@ -598,216 +846,424 @@ bool initWifi() {
   write_log(F("Launch the device in AP mode."));
 
   dnsServer.start(DNS_PORT, "*", apIP);
+  bootMark(BOOT_WIFI);
 
   return false;
 }
 
+// Start our own access point on apIP, for the first setup or when the wifi is lost
+void startSoftAP(const char* password) {
+#ifdef ESP32
+  WiFi.persistent(false); // fix crash esp32 https://github.com/espressif/arduino-esp32/issues/2025
+#endif
+
+  // use the default hostname for privacy
+  FixedString<32> apName = hostnamePrefix;
+  apName += getId();
+  WiFi.softAP(apName.c_str(), password);
+
+  // The AP must be up before changing its address, and the address applied before starting the DNS
+  waitFor([]() { return (uint32_t)WiFi.softAPIP() != 0; }, 2000);
+  WiFi.softAPConfig(apIP, apIP, netMsk);
+  waitFor([]() { return WiFi.softAPIP() == apIP; }, 2000);
+
+  //write_log(F("IP address: "));
+  //Serial.println(WiFi.softAPIP());
+}
+
 // Handler webserver response
 
-void sendWrappedHTML(String content) {
+String wrapHTML(const String& content) {
   String headerContent = FPSTR(html_common_header);
   String footerContent = FPSTR(html_common_footer);
   String toSend = headerContent + content + footerContent;
-  toSend.replace(F("_UNIT_NAME_"), hostname);
+  toSend.replace(F("_UNIT_NAME_"), hostname.c_str());
   toSend.replace(F("_VERSION_"), m2wifi_version);
-  server.send(200, F("text/html"), toSend);
+  heapTrackSample();
+  return toSend;
+}
+
+void sendWrappedHTML(AsyncWebServerRequest* request, String content, const char* cookie) {
+  AsyncWebServerResponse* response = request->beginResponse(200, F("text/html"), wrapHTML(content));
+  if (cookie) {
+    response->addHeader(F("Cache-Control"), F("no-cache"));
+    response->addHeader(F("Set-Cookie"), cookie);
+  }
+  request->send(response);
+}
+
+// 302, with a script for the browsers which don't follow redirects
+void sendRedirect(AsyncWebServerRequest* request, const char* location, bool script) {
+  String redirectPage;
+  if (script) {
+    redirectPage = F("<html lang=\"en\" class=\"\"><head><meta charset='utf-8'>");
+    redirectPage += F("<script>");
+    redirectPage += F("setTimeout(function () {");
+    redirectPage += F("window.location.href= '");
+    redirectPage += location;
+    redirectPage += F("';");
+    redirectPage += F("}, 1000);");
+    redirectPage += F("</script>");
+    redirectPage += F("</body></html>");
+  }
+  AsyncWebServerResponse* response = request->beginResponse(302, F("text/html"), redirectPage);
+  response->addHeader(F("Location"), location);
+  response->addHeader(F("Cache-Control"), F("no-cache"));
+  request->send(response);
 }
 
-void handleNotFound() {
+// Reboots are done by loop(), once the page is sent
+void scheduleReboot(bool format) {
+  rebootFormat = format;
+  rebootAt = millis() + 500;
+  if (rebootAt == 0) rebootAt = 1;
+}
+
+void handleNotFound(AsyncWebServerRequest* request) {
   if (captive) {
     String initSetupContent = FPSTR(html_init_setup);
-    initSetupContent.replace("_UNIT_NAME_", hostname);
-    sendWrappedHTML(initSetupContent);
+    initSetupContent.replace("_UNIT_NAME_", hostname.c_str());
+    sendWrappedHTML(request, initSetupContent);
   }
   else {
-    server.sendHeader("Location", "/");
-    server.sendHeader("Cache-Control", "no-cache");
-    server.send(302);
+    sendRedirect(request, "/");
     return;
   }
 }
 
-void handleSaveWifi() {
-  if (!checkLogin()) return;
+void handleSaveWifi(AsyncWebServerRequest* request) {
+  if (!checkLogin(request)) return;
 
   // write_log(F("Saving wifi config"));
-  if (server.method() == HTTP_POST) {
-    saveWifi(server.arg("ssid"), server.arg("psk"), server.arg("hn"), server.arg("otapwd"));
+  if (request->method() == HTTP_POST) {
+    ConfigGuard guard;
+    saveWifi(request->arg("ssid"), request->arg("psk"), request->arg("hn"), request->arg("otapwd"));
   }
   String initSavePage =  FPSTR(html_init_save);
-  sendWrappedHTML(initSavePage);
-  delay(500);
-  ESP.restart();
+  sendWrappedHTML(request, initSavePage);
+  scheduleReboot(false);
 }
 
-void handleReboot() {
-  if (!checkLogin()) return;
+void handleReboot(AsyncWebServerRequest* request) {
+  if (!checkLogin(request)) return;
 
   String initRebootPage = FPSTR(html_init_reboot);
-  sendWrappedHTML(initRebootPage);
-  delay(500);
-  ESP.restart();
+  sendWrappedHTML(request, initRebootPage);
+  scheduleReboot(false);
 }
 
-void handleRoot() {
-  if (!checkLogin()) return;
+void handleRoot(AsyncWebServerRequest* request) {
+  if (!checkLogin(request)) return;
 
-  if (server.hasArg("REBOOT")) {
+  if (request->hasArg("REBOOT")) {
     String rebootPage =  FPSTR(html_page_reboot);
     String countDown = FPSTR(count_down_script);
-    sendWrappedHTML(rebootPage + countDown);
-    delay(500);
-#ifdef ESP32
-    ESP.restart();
-#else
-    ESP.reset();
-#endif
+    sendWrappedHTML(request, rebootPage + countDown);
+    scheduleReboot(false);
   }
   else {
     String menuRootPage =  FPSTR(html_menu_root);
     menuRootPage.replace("_SHOW_LOGOUT_", (String)(login_password.length() > 0));
     //not show control button if hp not connected
-    menuRootPage.replace("_SHOW_CONTROL_", (String)(hp.isConnected()));
-    sendWrappedHTML(menuRootPage);
+    menuRootPage.replace("_SHOW_CONTROL_", (String)(hpRead().connected));
+    sendWrappedHTML(request, menuRootPage);
   }
 }
 
-void handleInitSetup() {
+void handleInitSetup(AsyncWebServerRequest* request) {
   String initSetupPage = FPSTR(html_init_setup);
 
-  sendWrappedHTML(initSetupPage);
+  sendWrappedHTML(request, initSetupPage);
 }
 
-void handleSetup() {
-  if (!checkLogin()) return;
+void handleSetup(AsyncWebServerRequest* request) {
+  if (!checkLogin(request)) return;
 
-  if (server.hasArg("RESET")) {
+  if (request->hasArg("RESET")) {
     String pageReset = FPSTR(html_page_reset);
     String ssid = hostnamePrefix;
     ssid += getId();
     pageReset.replace("_SSID_",ssid);
-    sendWrappedHTML(pageReset);
-    SPIFFS.format();
-    delay(500);
-#ifdef ESP32
-    ESP.restart();
-#else
-    ESP.reset();
-#endif
+    sendWrappedHTML(request, pageReset);
+    scheduleReboot(true);
   }
   else {
     String menuSetupPage = FPSTR(html_menu_setup);
-    sendWrappedHTML(menuSetupPage);
+    sendWrappedHTML(request, menuSetupPage);
   }
 
 }
 
-void handleLogs() {
+void handleLogs(AsyncWebServerRequest* request) {
 
   String menuLogsPage = FPSTR(html_menu_logs);
   menuLogsPage.replace("_LOGS_", LogString);
-  sendWrappedHTML(menuLogsPage);
+  sendWrappedHTML(request, menuLogsPage);
 
 }
 
-void rebootAndSendPage() {
-    String saveRebootPage =  FPSTR(html_page_save_reboot);
+// Settings are applied at runtime, just confirm
+void sendSavedPage(AsyncWebServerRequest* request) {
+    String savePage =  FPSTR(html_page_save);
     String countDown = FPSTR(count_down_script);
-    sendWrappedHTML(saveRebootPage + countDown);
-    delay(500);
-    ESP.restart();
+    sendWrappedHTML(request, savePage + countDown);
+}
+
+// Side effects of a saved configuration
+void applyConfig(uint8_t changes) {
+  configVersion++;
+  if (changes & CONFIG_MQTT) mqttSettingsVersion++;
+
+  if (changes & CONFIG_OTA) {
+#ifdef ESP32
+    otaRestart = true;
+#else
+    // The ESP8266 OTA listener keeps its first password, only a restart takes the new one
+    rebootAt = millis() + 1000;
+    if (rebootAt == 0) rebootAt = 1;
+#endif
+  }
+
+  // Give some time for the page to be sent before dropping the connection
+  if (changes & CONFIG_WIFI) {
+    wifiRestartAt = millis() + 1000;
+    if (wifiRestartAt == 0) wifiRestartAt = 1;
+  }
+}
+
+// Controlled reconnection with new wifi settings
+void wifiRestart() {
+  write_log(F("Reconnecting with new wifi settings"));
+  WiFi.disconnect();
+  wifiRetries = 0;
+  // The cached connection can be for an old network
+  wifi_channel = 0;
+  wifiState = WIFI_STATE_OFF;
+  if (!ap_ssid.isEmpty()) {
+    wifiBegin();
+  }
 }
 
-String Page;
-void handleJson() {
-  Page = "{\"return\":\"ok\"}";
+// Queue the changes requested by a /json (or MQTT) command, returns false if the queue was full
+bool hpJsonCommands(JsonObject obj, HpCommandQueue& queue) {
+  HpState state = hpRead().settings;
+  bool queued = true;
 
-  if (server.method() == HTTP_POST) {
-    DynamicJsonDocument doc(JSON_OBJECT_SIZE(4) + 200);
-    DeserializationError err = deserializeJson(doc, server.arg("plain"));
-    if (!err)
+  if (obj.containsKey("power"))
+  {
+    HpPower power = hpParsePower(obj["power"]);
+    if (power != HP_POWER_UNKNOWN && power != state.power)
     {
-      JsonObject obj = doc.as<JsonObject>();
+      queued &= hpQueueCommand(queue, HP_CMD_POWER, power);
+    }
+  }
+  if (obj.containsKey("mode"))
+  {
+    HpMode mode = hpParseMode(obj["mode"]);
+    if (mode != HP_MODE_UNKNOWN && mode != state.mode)
+    {
+      queued &= hpQueueCommand(queue, HP_CMD_MODE, mode);
+    }
+  }
+  if (obj.containsKey("fan"))
+  {
+    HpFan fan = hpParseFan(obj["fan"]);
+    if (fan != HP_FAN_UNKNOWN && fan != state.fan)
+    {
+      queued &= hpQueueCommand(queue, HP_CMD_FAN, fan);
+    }
+  }
+  if (obj.containsKey("temperature"))
+  {
+    float temperature = convertLocalUnitToCelsius(obj["temperature"].as<float>(), useFahrenheit);
+    if (state.temperature != temperature)
+    {
+      queued &= hpQueueCommand(queue, HP_CMD_TEMPERATURE, 0, temperature);
+    }
+  }
+  if (obj.containsKey("vane"))
+  {
+    HpVane vane = hpParseVane(obj["vane"]);
+    if (vane != HP_VANE_UNKNOWN && vane != state.vane)
+    {
+      queued &= hpQueueCommand(queue, HP_CMD_VANE, vane);
+    }
+  }
+  if (obj.containsKey("widevane"))
+  {
+    HpWideVane wideVane = hpParseWideVane(obj["widevane"]);
+    if (wideVane != HP_WIDEVANE_UNKNOWN && wideVane != state.wideVane)
+    {
+      queued &= hpQueueCommand(queue, HP_CMD_WIDEVANE, wideVane);
+    }
+  }
+  return queued;
+}
 
-      if (login_password.length() == 0 || obj["pass"].as<String>() == login_password)
-      {
+// Commands a /json request can send to the unit, for the write budget
+uint8_t hpJsonCommandCount(JsonObject obj) {
+  static const char* const keys[] = {"power", "mode", "fan", "temperature", "vane", "widevane"};
+  uint8_t count = obj["command"] == "update" ? 1 : 0;
+  for (const char* key : keys) {
+    if (obj.containsKey(key)) count++;
+  }
+  return count;
+}
+
+// Request body of /json, kept raw as MessagePack can contain null bytes.
+// Streamed by chunks into a buffer owned by the request, freed with it.
+#define JSON_BODY_SIZE 512
+
+void handleJsonBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
+  if (total > JSON_BODY_SIZE) return;   // no body, the handler answers 413
+  if (index == 0) request->_tempObject = malloc(total);
+  if (request->_tempObject == nullptr) return;
+  memcpy((uint8_t*)request->_tempObject + index, data, len);
+}
+
+// Raw body dropped by handleJsonBody
+bool requestTooLarge(AsyncWebServerRequest* request) {
+  return request->_tempObject == nullptr && request->contentLength() > JSON_BODY_SIZE &&
+         !request->hasParam("body", true);
+}
+
+// Body collected by handleJsonBody, or json sent as a form (curl -d), which the server
+// keeps as a single "body" field
+bool requestBody(AsyncWebServerRequest* request, const char*& body, size_t& length) {
+  if (request->_tempObject) {
+    body = (const char*)request->_tempObject;
+    length = request->contentLength();
+    return true;
+  }
+  if (request->hasParam("body", true)) {
+    const String& value = request->getParam("body", true)->value();
+    body = value.c_str();
+    length = value.length();
+    return true;
+  }
+  return false;
+}
 
-        heatpumpSettings settings = hp.getSettings();
+// JSON or MessagePack, following the request Content-Type
+void sendJsonReturn(AsyncWebServerRequest* request, const char* result, bool msgpack, int code, uint32_t retryAfter) {
+  StaticJsonDocument<JSON_OBJECT_SIZE(1)> reply;
+  reply["return"] = result;
+
+  AsyncWebServerResponse* response;
+  if (msgpack) {
+    AsyncResponseStream* stream = request->beginResponseStream(F("application/msgpack"));
+    serializeMsgPack(reply, *stream);
+    response = stream;
+  }
+  else {
+    String page;
+    serializeJson(reply, page);
+    response = request->beginResponse(200, F("application/json; charset=utf-8"), page);
+  }
+  response->setCode(code);
+  if (retryAfter) {
+    response->addHeader(F("Retry-After"), String(retryAfter));
+  }
+  request->send(response);
+}
+
+// 429 for the pages, retryAfter in seconds
+void sendTooManyRequests(AsyncWebServerRequest* request, uint32_t retryAfter) {
+  AsyncWebServerResponse* response = request->beginResponse(429, F("text/plain"), F("Too many requests"));
+  response->addHeader(F("Retry-After"), String(retryAfter));
+  request->send(response);
+}
+
+uint32_t clientIp(AsyncWebServerRequest* request) {
+  return (uint32_t)request->client()->remoteIP();
+}
+
+void handleJson(AsyncWebServerRequest* request) {
+  const char* result = "ok";
+  bool msgpack = request->contentType().startsWith(F("application/msgpack"));
+  const char* body;
+  size_t length;
+
+  // Before anything is parsed, a flooding client costs a table lookup
+  uint32_t retryAfter = rateLimiter.admit(clientIp(request), RATE_JSON);
+  if (retryAfter) {
+    sendJsonReturn(request, "Too many requests", msgpack, 429, retryAfter);
+    return;
+  }
+
+  if (request->method() == HTTP_POST) {
+    if (requestTooLarge(request)) {
+      sendJsonReturn(request, "Request too large", msgpack, 413);
+      return;
+    }
+    StaticJsonDocument<JSON_OBJECT_SIZE(8) + 200> doc;
+    DeserializationError err = DeserializationError::EmptyInput;
+    if (requestBody(request, body, length)) {
+      err = msgpack ? deserializeMsgPack(doc, body, length) : deserializeJson(doc, body, length);
+    }
+    if (err)
+    {
+      result = "Bad request";
+    }
+    else
+    {
+      JsonObject obj = doc.as<JsonObject>();
 
+      if (login_password.length() == 0 || login_password == obj["pass"].as<const char*>())
+      {
+        retryAfter = rateLimiter.admitWrites(hpJsonCommandCount(obj));
+        if (retryAfter) {
+          sendJsonReturn(request, "Too many requests", msgpack, 429, retryAfter);
+          return;
+        }
         if (obj.containsKey("command"))
         {
           if (obj["command"] == "update")
           {
-            hpSettingsChanged();
+            hpQueueCommand(webCommands, HP_CMD_REFRESH);
+            // a request left without response would stay open on the async server
+            sendJsonReturn(request, result, msgpack);
             return;
           }
           if (obj["command"] == "reboot")
           {
+            sendJsonReturn(request, result, msgpack);
             return;
           }
         }
-        if (obj.containsKey("power"))
-        {
-          if (settings.power != obj["power"])
-          {
-            hp.setPowerSetting(strcmp (obj["power"], "on") == 0);
-          }
-        }
-        if (obj.containsKey("mode"))
-        {
-          if (settings.mode != obj["mode"])
-          {
-           hp.setModeSetting(obj["mode"].as<const char*>());
-          }
-        }
-        if (obj.containsKey("fan"))
-        {
-          if (settings.fan != obj["fan"])
-          {
-           hp.setFanSpeed(obj["fan"].as<const char*>());
-          }
-        }
-        if (obj.containsKey("temperature"))
+        bool queued = hpJsonCommands(obj, webCommands);
+        if (obj.containsKey("remoteTemperature"))
         {
-          if (settings.temperature != obj["temperature"])
-          {
-           hp.setTemperature(obj["temperature"].as<float>());
-          }
+          queued &= webRemoteTemps.push(obj["remoteTemperature"].as<float>());
         }
-        if (obj.containsKey("vane"))
-        {
-          if (settings.vane != obj["temperature"])
-          {
-           hp.setVaneSetting(obj["vane"].as<const char*>());
-          }
-        }       
-        if (obj.containsKey("widevane"))
+
+        if (!queued)
         {
-          if (settings.vane != obj["widevane"])
-          {
-           hp.setWideVaneSetting(obj["widevane"].as<const char*>());
-          }
+          result = "busy";
         }
 
       }
       else
       {
-        Page = "{\"return\":\"Bad password\"}";
+        result = "Bad password";
       }
 
 
     }
   }
 
-  server.send(200, F("application/json; charset=utf-8"), Page);
+  sendJsonReturn(request, result, msgpack);
 }
 
-void handleOthers() {
-  if (!checkLogin()) return;
+void handleOthers(AsyncWebServerRequest* request) {
+  if (!checkLogin(request)) return;
 
-  if (server.method() == HTTP_POST) {
-    saveOthers(server.arg("HAA"), server.arg("haat"), server.arg("DebugPckts"),server.arg("DebugLogs"));
-    rebootAndSendPage();
+  if (request->method() == HTTP_POST) {
+    ConfigGuard guard;
+    saveOthers(request->arg("HAA"), request->arg("haat"), request->arg("DebugPckts"),request->arg("DebugLogs"),
+               request->arg("PollFast"), request->arg("PollSlow"));
+    applyConfig(0);
+    sendSavedPage(request);
   }
   else {
     String othersPage =  FPSTR(html_page_others);
@@ -824,84 +1280,154 @@ void handleOthers() {
     else {
       othersPage.replace("_DEBUG_LOGS_OFF_", "selected");
     }
-    sendWrappedHTML(othersPage);
+    othersPage.replace(F("_POLL_FAST_"), String(hp_poll_fast_ms));
+    othersPage.replace(F("_POLL_SLOW_"), String(hp_poll_slow_ms));
+    sendWrappedHTML(request, othersPage);
   }
 }
 
-void handleServer() {
+void handleServer(AsyncWebServerRequest* request) {
 
-  if (!checkLogin()) return;
+  if (!checkLogin(request)) return;
 
-  if (server.method() == HTTP_POST)
+  if (request->method() == HTTP_POST)
   {
-    saveServerSettings(server.arg("ip"), server.arg("url"), server.arg("port"));
-    rebootAndSendPage();
+    ConfigGuard guard;
+    bool mqttChanged = false;
+#ifdef USE_MQTT
+    // Compared once stored, the fixed strings may truncate what was sent
+    auto mqttSettings = []() {
+      return String(mqtt_server.c_str()) + '\n' + mqtt_port + '\n' + mqtt_user.c_str() + '\n' + mqtt_pwd.c_str() + '\n' +
+             mqtt_topic.c_str();
+    };
+    String before = mqttSettings();
+    mqtt_server = request->arg("mh");
+    mqtt_port = request->arg("mp").toInt() > 0 ? request->arg("mp").toInt() : 1883;
+    mqtt_user = request->arg("mu");
+    mqtt_pwd = request->arg("mpw");
+    if (request->arg("mt").length() > 0) mqtt_topic = request->arg("mt");
+    mqttChanged = mqttSettings() != before;
+#endif
+    // Only a multicast group (224.0.0.0/4), anything else disables the announcements
+    IPAddress group;
+    bool multicast = group.fromString(request->arg("mg")) && (group[0] & 0xF0) == 0xE0;
+    mcast_group = multicast ? (uint32_t)group : 0;
+    mcast_port = request->arg("mgp").toInt() > 0 ? request->arg("mgp").toInt() : 4211;
+    server_msgpack = (request->arg("pf") == "msgpack");
+    saveServerSettings(request->arg("ip"), request->arg("url"), request->arg("port"));
+    applyConfig(mqttChanged ? CONFIG_MQTT : 0);
+    sendSavedPage(request);
   }
   else {
     String ServerPage =  FPSTR(html_page_server);
-    ServerPage.replace(F("_SERVER_URL_"), server_url);
+    ServerPage.replace(F("_SERVER_URL_"), server_url.c_str());
+    ServerPage.replace(F("_MCAST_GROUP_"), mcast_group ? IPAddress(mcast_group).toString() : String());
+    ServerPage.replace(F("_MCAST_PORT_"), String(mcast_port));
+    ServerPage.replace(server_msgpack ? F("_PUSH_MSGPACK_") : F("_PUSH_JSON_"), F("selected"));
+#ifdef USE_MQTT
+    ServerPage.replace(F("_MQTT_SERVER_"), mqtt_server.c_str());
+    ServerPage.replace(F("_MQTT_PORT_"), String(mqtt_port));
+    ServerPage.replace(F("_MQTT_USER_"), mqtt_user.c_str());
+    ServerPage.replace(F("_MQTT_PWD_"), mqtt_pwd.c_str());
+    ServerPage.replace(F("_MQTT_TOPIC_"), mqtt_topic.c_str());
+#endif
 
-    sendWrappedHTML(ServerPage);
+    sendWrappedHTML(request, ServerPage);
   }
 }
 
-void handleUnit() {
-  if (!checkLogin()) return;
+void handleUnit(AsyncWebServerRequest* request) {
+  if (!checkLogin(request)) return;
 
-  if (server.method() == HTTP_POST) {
-    saveUnit(server.arg("tu"), server.arg("md"), server.arg("lpw"), (String)convertLocalUnitToCelsius(server.arg("min_temp").toFloat(), useFahrenheit), (String)convertLocalUnitToCelsius(server.arg("max_temp").toFloat(), useFahrenheit), server.arg("temp_step"));
-    rebootAndSendPage();
+  if (request->method() == HTTP_POST) {
+    // the limits are given in the unit selected in the same form
+    bool fahrenheit = (request->arg("tu") == "fah");
+    ConfigGuard guard;
+    saveUnit(request->arg("tu"), request->arg("md"), request->arg("lpw"), (String)convertLocalUnitToCelsius(request->arg("min_temp").toFloat(), fahrenheit), (String)convertLocalUnitToCelsius(request->arg("max_temp").toFloat(), fahrenheit), request->arg("temp_step"));
+    applyConfig(0);
+    sendSavedPage(request);
   }
   else {
     String unitPage =  FPSTR(html_page_unit);
     unitPage.replace(F("_MIN_TEMP_"), String(convertCelsiusToLocalUnit(min_temp, useFahrenheit)));
     unitPage.replace(F("_MAX_TEMP_"), String(convertCelsiusToLocalUnit(max_temp, useFahrenheit)));
-    unitPage.replace(F("_TEMP_STEP_"), String(temp_step));
+    unitPage.replace(F("_TEMP_STEP_"), temp_step.c_str());
     //temp
     if (useFahrenheit) unitPage.replace(F("_TU_FAH_"), F("selected"));
     else unitPage.replace(F("_TU_CEL_"), F("selected"));
     //mode
     if (supportHeatMode) unitPage.replace(F("_MD_ALL_"), F("selected"));
     else unitPage.replace(F("_MD_NONHEAT_"), F("selected"));
-    unitPage.replace(F("_LOGIN_PASSWORD_"), login_password);
-    sendWrappedHTML(unitPage);
+    unitPage.replace(F("_LOGIN_PASSWORD_"), login_password.c_str());
+    sendWrappedHTML(request, unitPage);
   }
 }
 
-void handleWifi() {
-  if (!checkLogin()) return;
-
-  if (server.method() == HTTP_POST) {
-    saveWifi(server.arg("ssid"), server.arg("psk"), server.arg("hn"), server.arg("otapwd"));
-    rebootAndSendPage();
-#ifdef ESP32
-    ESP.restart();
-#else
-    ESP.reset();
-#endif
+void handleWifi(AsyncWebServerRequest* request) {
+  if (!checkLogin(request)) return;
+
+  if (request->method() == HTTP_POST) {
+    ConfigGuard guard;
+    bool changed = false;
+    for (uint8_t i = 1; i < WIFI_MAX_NETWORKS; i++) {
+      String ssid = request->arg("ssid" + String(i + 1));
+      String pwd = request->arg("psk" + String(i + 1));
+      // A new network starts with a clean history
+      if (wifi_ssid[i - 1] != ssid) {
+        memset(&wifi_history[i], 0, sizeof(WifiHistory));
+        changed = true;
+      }
+      changed = changed || wifi_pwd[i - 1] != pwd;
+      wifi_ssid[i - 1] = ssid;
+      wifi_pwd[i - 1] = pwd;
+    }
+    if (ap_ssid != request->arg("ssid")) {
+      memset(&wifi_history[0], 0, sizeof(WifiHistory));
+      changed = true;
+    }
+    changed = changed || ap_pwd != request->arg("psk") || hostname != request->arg("hn");
+    wifi_roaming = (request->arg("roam") == "ON");
+    String otaBefore = String(hostname.c_str()) + '\n' + ota_pwd.c_str();
+    saveWifi(request->arg("ssid"), request->arg("psk"), request->arg("hn"), request->arg("otapwd"));
+    bool otaChanged = String(hostname.c_str()) + '\n' + ota_pwd.c_str() != otaBefore;
+    applyConfig((changed ? CONFIG_WIFI : 0) | (otaChanged ? CONFIG_OTA : 0));
+    sendSavedPage(request);
   }
   else {
     String wifiPage =  FPSTR(html_page_wifi);
-    String str_ap_ssid = ap_ssid;
-    String str_ap_pwd  = ap_pwd;
-    String str_ota_pwd = ota_pwd;
+    String str_ap_ssid = ap_ssid.c_str();
+    String str_ap_pwd  = ap_pwd.c_str();
+    String str_ota_pwd = ota_pwd.c_str();
     str_ap_ssid.replace("'", F("&apos;"));
     str_ap_pwd.replace("'", F("&apos;"));
     str_ota_pwd.replace("'", F("&apos;"));
     wifiPage.replace(F("_SSID_"), str_ap_ssid);
     wifiPage.replace(F("_PSK_"), str_ap_pwd);
     wifiPage.replace(F("_OTA_PWD_"), str_ota_pwd);
-    sendWrappedHTML(wifiPage);
+    for (uint8_t i = 1; i < WIFI_MAX_NETWORKS; i++) {
+      String ssid = wifi_ssid[i - 1].c_str();
+      String pwd = wifi_pwd[i - 1].c_str();
+      ssid.replace("'", F("&apos;"));
+      pwd.replace("'", F("&apos;"));
+      wifiPage.replace("_SSID" + String(i + 1) + "_", ssid);
+      wifiPage.replace("_PSK" + String(i + 1) + "_", pwd);
+    }
+    wifiPage.replace(wifi_roaming ? F("_ROAM_ON_") : F("_ROAM_OFF_"), F("selected"));
+    sendWrappedHTML(request, wifiPage);
   }
 
 }
 
-void handleStatus() {
-  if (!checkLogin()) return;
+void handleStatus(AsyncWebServerRequest* request) {
+  if (!checkLogin(request)) return;
+
+  uint32_t version;
+  HpSnapshot snapshot = hpRead(&version);
+  if (responseCache.serve(request, CACHE_STATUS, version, configVersion)) return;
 
   String statusPage =  FPSTR(html_page_status);
 
-  //if (server.hasArg("mrconn")) mqttConnect();
+  //if (request->hasArg("mrconn")) mqttConnect();
 
   String connected = F("<span style='color:#47c266'><b>");
   connected += FPSTR("CONNECTED");
@@ -911,266 +1437,255 @@ void handleStatus() {
   disconnected += FPSTR("DISCONNECTED");
   disconnected += F("</b></span>");
 
-  if ((Serial) and hp.isConnected()) statusPage.replace(F("_HVAC_STATUS_"), connected);
+  if ((Serial) and snapshot.connected) statusPage.replace(F("_HVAC_STATUS_"), connected);
   else  statusPage.replace(F("_HVAC_STATUS_"), disconnected);
 
   statusPage.replace(F("_HVAC_RETRIES_"), String(hpConnectionTotalRetries));
+  String poll(hpPollInterval);
+  poll += hpPollInterval == hp_poll_fast_ms ? " ms (active), " : " ms (idle), ";
+  poll += String(hpPollRate);
+  poll += " polls/min";
+  statusPage.replace(F("_HVAC_POLL_"), poll);
+  statusPage.replace(F("_EVENT_BUS_"), hpBus.report());
 
   statusPage.replace(F("_WIFI_STATUS_"), String(WiFi.RSSI()));
+  String connectTime(wifiConnectDuration);
+  connectTime += wifiConnectWasFast ? " ms (fast)" : " ms";
+  if (WiFi.status() == WL_CONNECTED) {
+    connectTime += " on ";
+    connectTime += WiFi.SSID();
+  }
+  statusPage.replace(F("_WIFI_CONNECT_TIME_"), connectTime);
 
   // get free heap and percent
-  // Better than esp_get_free_heap_size() ?
-#ifdef ESP32
-  uint32_t freeHeapBytes = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
-  uint32_t totalHeapBytes = heap_caps_get_total_size(MALLOC_CAP_DEFAULT);
-#else
-  uint32_t freeHeapBytes = ESP.getFreeHeap();
-  uint32_t totalHeapBytes = 64000;
-#endif
+  uint32_t freeHeapBytes = heapFree();
+  uint32_t totalHeapBytes = heapTotal();
   float percentageHeapFree = freeHeapBytes * 100.0f / (float)totalHeapBytes;
   String heap(freeHeapBytes);
   heap += " (";
   heap += String(percentageHeapFree);
-  heap += "% )";
+  heap += "% ), largest block ";
+  heap += String(heapLargestBlock());
   statusPage.replace(F("_FREE_HEAP_"), heap);
   statusPage.replace(F("_COMPIL_DATE_"), compile_date);
   statusPage.replace(F("_BOOT_TIME_"), "<font color='orange'><b>" + getUpTime() + "</b></font>");
+  statusPage.replace(F("_BOOT_TIMELINE_"), getBootTimeline());
 
-  sendWrappedHTML(statusPage);
+  responseCache.send(request, CACHE_STATUS, version, configVersion, "text/html", wrapHTML(statusPage));
 }
 
 
 
-void handleControl()
+// Mark the option of the current value as selected, unknown values have no placeholder
+void selectOption(String& page, const char* placeholder) {
+  if (placeholder[0] != '\0') page.replace(placeholder, "selected");
+}
+
+void handleControl(AsyncWebServerRequest* request)
 {
-  if (!checkLogin()) return;
+  if (!checkLogin(request)) return;
+
+  uint32_t version;
+  HpSnapshot snapshot = hpRead(&version);
 
   //not connected to hp, redirect to status page
-  if (!hp.isConnected()) {
-    server.sendHeader("Location", "/status");
-    server.sendHeader("Cache-Control", "no-cache");
-    server.send(302);
+  if (!snapshot.connected) {
+    sendRedirect(request, "/status");
     return;
   }
 
+  // Only the plain page is cached, a command changes what is shown
+  bool cacheable = request->params() == 0;
+  if (cacheable && responseCache.serve(request, CACHE_CONTROL, version, configVersion)) return;
+
+  if (!cacheable) {
+    static const char* const commandArgs[] = {"CONNECT", "POWER", "MODE", "TEMP", "FAN", "VANE", "WIDEVANE"};
+    uint8_t commands = 0;
+    for (const char* arg : commandArgs) {
+      if (request->hasArg(arg)) commands++;
+    }
+    uint32_t retryAfter = rateLimiter.admit(clientIp(request), RATE_CONTROL);
+    if (!retryAfter) retryAfter = rateLimiter.admitWrites(commands);
+    if (retryAfter) {
+      sendTooManyRequests(request, retryAfter);
+      return;
+    }
+  }
+
   //Update settings if request
-  heatpumpSettings settings = hp.getSettings();
+  HpState state = snapshot.settings;
 
-  if (server.hasArg("CONNECT")) {
-    hp.connect(&Serial);
+  if (request->hasArg("CONNECT")) {
+    hpQueueCommand(webCommands, HP_CMD_CONNECT);
   }
   else {
 
-    if (server.hasArg("POWER")) {
-      settings.power = server.arg("POWER").c_str();
-      hp.setPowerSetting(server.arg("POWER") == "ON");
+    if (request->hasArg("POWER")) {
+      HpPower power = hpParsePower(request->arg("POWER").c_str());
+      if (power != HP_POWER_UNKNOWN) {
+        state.power = power;
+        hpQueueCommand(webCommands, HP_CMD_POWER, power);
+      }
     }
-    if (server.hasArg("MODE")) {
-      settings.mode = server.arg("MODE").c_str();
-      hp.setModeSetting(server.arg("MODE").c_str());
+    if (request->hasArg("MODE")) {
+      HpMode mode = hpParseMode(request->arg("MODE").c_str());
+      if (mode != HP_MODE_UNKNOWN) {
+        state.mode = mode;
+        hpQueueCommand(webCommands, HP_CMD_MODE, mode);
+      }
     }
-    if (server.hasArg("TEMP")) {
-      settings.temperature = convertLocalUnitToCelsius(server.arg("TEMP").toFloat(), useFahrenheit);
-      hp.setTemperature(server.arg("TEMP").toFloat());
+    if (request->hasArg("TEMP")) {
+      state.temperature = convertLocalUnitToCelsius(request->arg("TEMP").toFloat(), useFahrenheit);
+      hpQueueCommand(webCommands, HP_CMD_TEMPERATURE, 0, state.temperature);
     }
-    if (server.hasArg("FAN")) {
-      settings.fan = server.arg("FAN").c_str();
-      hp.setFanSpeed(server.arg("FAN").c_str());
+    if (request->hasArg("FAN")) {
+      HpFan fan = hpParseFan(request->arg("FAN").c_str());
+      if (fan != HP_FAN_UNKNOWN) {
+        state.fan = fan;
+        hpQueueCommand(webCommands, HP_CMD_FAN, fan);
+      }
     }
-    if (server.hasArg("VANE")) {
-      settings.vane = server.arg("VANE").c_str();
-      hp.setVaneSetting(server.arg("VANE").c_str());
+    if (request->hasArg("VANE")) {
+      HpVane vane = hpParseVane(request->arg("VANE").c_str());
+      if (vane != HP_VANE_UNKNOWN) {
+        state.vane = vane;
+        hpQueueCommand(webCommands, HP_CMD_VANE, vane);
+      }
     }
-    if (server.hasArg("WIDEVANE")) {
-      settings.wideVane = server.arg("WIDEVANE").c_str();
-      hp.setWideVaneSetting(server.arg("WIDEVANE").c_str());
+    if (request->hasArg("WIDEVANE")) {
+      HpWideVane wideVane = hpParseWideVane(request->arg("WIDEVANE").c_str());
+      if (wideVane != HP_WIDEVANE_UNKNOWN) {
+        state.wideVane = wideVane;
+        hpQueueCommand(webCommands, HP_CMD_WIDEVANE, wideVane);
+      }
     }
 
   }
 
   String controlPage =  FPSTR(html_page_control);
-  String headerContent = FPSTR(html_common_header);
-  String footerContent = FPSTR(html_common_footer);
   //write_log("Enter HVAC control");
-  headerContent.replace("_UNIT_NAME_", hostname);
-  footerContent.replace("_VERSION_", m2wifi_version);
-  controlPage.replace("_UNIT_NAME_", hostname);
+  controlPage.replace("_UNIT_NAME_", hostname.c_str());
   controlPage.replace("_RATE_", "60");
-  controlPage.replace("_ROOMTEMP_", String(convertCelsiusToLocalUnit(hp.getRoomTemperature(), useFahrenheit)));
+  controlPage.replace("_ROOMTEMP_", String(convertCelsiusToLocalUnit(snapshot.roomTemperature, useFahrenheit)));
   controlPage.replace("_USE_FAHRENHEIT_", (String)useFahrenheit);
   controlPage.replace("_TEMP_SCALE_", getTemperatureScale());
   controlPage.replace("_HEAT_MODE_SUPPORT_", (String)supportHeatMode);
   controlPage.replace(F("_MIN_TEMP_"), String(convertCelsiusToLocalUnit(min_temp, useFahrenheit)));
   controlPage.replace(F("_MAX_TEMP_"), String(convertCelsiusToLocalUnit(max_temp, useFahrenheit)));
-  controlPage.replace(F("_TEMP_STEP_"), String(temp_step));
+  controlPage.replace(F("_TEMP_STEP_"), temp_step.c_str());
 
-  if (strcmp(settings.power, "ON") == 0) {
-    controlPage.replace("_POWER_ON_", "selected");
-  }
-  else if (strcmp(settings.power, "OFF") == 0) {
-    controlPage.replace("_POWER_OFF_", "selected");
-  }
+  selectOption(controlPage, hpPowerNames[state.power].placeholder);
+  selectOption(controlPage, hpModeNames[state.mode].placeholder);
+  selectOption(controlPage, hpFanNames[state.fan].placeholder);
+  selectOption(controlPage, hpVaneNames[state.vane].placeholder);
+  selectOption(controlPage, hpWideVaneNames[state.wideVane].placeholder);
+  controlPage.replace("_TEMP_", String(convertCelsiusToLocalUnit(state.temperature, useFahrenheit)));
 
-  if (strcmp(settings.mode, "HEAT") == 0) {
-    controlPage.replace("_MODE_H_", "selected");
-  }
-  else if (strcmp(settings.mode, "DRY") == 0) {
-    controlPage.replace("_MODE_D_", "selected");
-  }
-  else if (strcmp(settings.mode, "COOL") == 0) {
-    controlPage.replace("_MODE_C_", "selected");
-  }
-  else if (strcmp(settings.mode, "FAN") == 0) {
-    controlPage.replace("_MODE_F_", "selected");
-  }
-  else if (strcmp(settings.mode, "AUTO") == 0) {
-    controlPage.replace("_MODE_A_", "selected");
-  }
+  if (cacheable) responseCache.send(request, CACHE_CONTROL, version, configVersion, "text/html", wrapHTML(controlPage));
+  else sendWrappedHTML(request, controlPage);
+}
 
-  if (strcmp(settings.fan, "AUTO") == 0) {
-    controlPage.replace("_FAN_A_", "selected");
-  }
-  else if (strcmp(settings.fan, "QUIET") == 0) {
-    controlPage.replace("_FAN_Q_", "selected");
-  }
-  else if (strcmp(settings.fan, "1") == 0) {
-    controlPage.replace("_FAN_1_", "selected");
-  }
-  else if (strcmp(settings.fan, "2") == 0) {
-    controlPage.replace("_FAN_2_", "selected");
-  }
-  else if (strcmp(settings.fan, "3") == 0) {
-    controlPage.replace("_FAN_3_", "selected");
-  }
-  else if (strcmp(settings.fan, "4") == 0) {
-    controlPage.replace("_FAN_4_", "selected");
-  }
+void handleDebugHeap(AsyncWebServerRequest* request) {
+  if (!checkLogin(request)) return;
 
-  controlPage.replace("_VANE_V_", settings.vane);
-  if (strcmp(settings.vane, "AUTO") == 0) {
-    controlPage.replace("_VANE_A_", "selected");
-  }
-  else if (strcmp(settings.vane, "1") == 0) {
-    controlPage.replace("_VANE_1_", "selected");
-  }
-  else if (strcmp(settings.vane, "2") == 0) {
-    controlPage.replace("_VANE_2_", "selected");
-  }
-  else if (strcmp(settings.vane, "3") == 0) {
-    controlPage.replace("_VANE_3_", "selected");
-  }
-  else if (strcmp(settings.vane, "4") == 0) {
-    controlPage.replace("_VANE_4_", "selected");
-  }
-  else if (strcmp(settings.vane, "5") == 0) {
-    controlPage.replace("_VANE_5_", "selected");
-  }
-  else if (strcmp(settings.vane, "SWING") == 0) {
-    controlPage.replace("_VANE_S_", "selected");
-  }
+  request->send(200, F("application/json; charset=utf-8"), heapReport());
+}
 
-  controlPage.replace("_WIDEVANE_V_", settings.wideVane);
-  if (strcmp(settings.wideVane, "<<") == 0) {
-    controlPage.replace("_WVANE_1_", "selected");
-  }
-  else if (strcmp(settings.wideVane, "<") == 0) {
-    controlPage.replace("_WVANE_2_", "selected");
-  }
-  else if (strcmp(settings.wideVane, "|") == 0) {
-    controlPage.replace("_WVANE_3_", "selected");
-  }
-  else if (strcmp(settings.wideVane, ">") == 0) {
-    controlPage.replace("_WVANE_4_", "selected");
-  }
-  else if (strcmp(settings.wideVane, ">>") == 0) {
-    controlPage.replace("_WVANE_5_", "selected");
-  }
-  else if (strcmp(settings.wideVane, "<>") == 0) {
-    controlPage.replace("_WVANE_6_", "selected");
-  }
-  else if (strcmp(settings.wideVane, "SWING") == 0) {
-    controlPage.replace("_WVANE_S_", "selected");
-  }
-  controlPage.replace("_TEMP_", String(convertCelsiusToLocalUnit(hp.getTemperature(), useFahrenheit)));
+// Human readable copy of the binary config, secrets are left out
+void handleConfigExport(AsyncWebServerRequest* request) {
+  if (!checkLogin(request)) return;
+
+  StaticJsonDocument<JSON_OBJECT_SIZE(22) + JSON_ARRAY_SIZE(SUBSCRIPTION_MAX) + 16> doc;
+  doc["version"] = CONFIG_VERSION;
+  doc["hostname"] = hostname.c_str();
+  doc["ap_ssid"] = ap_ssid.c_str();
+  doc["server_url"] = server_url.c_str();
+  doc["server_format"] = server_msgpack ? "msgpack" : "json";
+  SubscriptionRecord records[SUBSCRIPTION_MAX];
+  subCopy(records);
+  JsonArray subs = doc.createNestedArray("subscriptions");
+  for (uint8_t i = 0; i < SUBSCRIPTION_MAX; i++) {
+    if (!records[i].url.isEmpty()) subs.add(records[i].url.c_str());
+  }
+  doc["mqtt_server"] = mqtt_server.c_str();
+  doc["mqtt_port"] = mqtt_port;
+  doc["mqtt_user"] = mqtt_user.c_str();
+  doc["mqtt_topic"] = mqtt_topic.c_str();
+  doc["mcast_group"] = IPAddress(mcast_group).toString();
+  doc["mcast_port"] = mcast_port;
+  doc["unit_tempUnit"] = useFahrenheit ? "fah" : "cel";
+  doc["min_temp"] = min_temp;
+  doc["max_temp"] = max_temp;
+  doc["temp_step"] = temp_step.c_str();
+  doc["support_mode"] = supportHeatMode ? "all" : "nht";
+  doc["debugPckts"] = _debugModePckts ? "ON" : "OFF";
+  doc["debugLogs"] = _debugModeLogs ? "ON" : "OFF";
+  doc["hp_poll_fast_ms"] = hp_poll_fast_ms;
+  doc["hp_poll_slow_ms"] = hp_poll_slow_ms;
+
+  String out;
+  serializeJsonPretty(doc, out);
+  request->send(200, F("application/json; charset=utf-8"), out);
+}
 
-  // We need to send the page content in chunks to overcome
-  // a limitation on the maximum size we can send at one
-  // time (approx 6k).
-  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
-  server.send(200, "text/html", headerContent);
-  server.sendContent(controlPage);
-  server.sendContent(footerContent);
-  // Signal the end of the content
-  server.sendContent("");
-  //delay(100);
+// Server counters, always current even when the rest of /metrics comes from the cache
+String metricsLive() {
+  String live = FPSTR(html_metrics_live);
+  live.replace("_UNIT_NAME_", hostname.c_str());
+  live.replace("_CACHE_HITS_", String(responseCache.hits));
+  live.replace("_CACHE_MISSES_", String(responseCache.misses));
+  live.replace("_CACHE_BYTES_", String(responseCache.poolBytes()));
+  live.replace("_RATE_LIMITED_", String(rateLimiter.rejected));
+  return live;
 }
 
-void handleMetrics(){
+void handleMetrics(AsyncWebServerRequest* request){
+  uint32_t version;
+  HpSnapshot snapshot = hpRead(&version);
+  if (responseCache.serve(request, CACHE_METRICS, version, configVersion, metricsLive)) return;
+
   String metrics =    FPSTR(html_metrics);
+  const HpState& state = snapshot.settings;
+
+  String hppower = String(hpPowerNames[state.power].metric);
+  String hpfan = String(hpFanNames[state.fan].metric);
+  String hpvane = String(hpVaneNames[state.vane].metric);
+  String hpwidevane = String(hpWideVaneNames[state.wideVane].metric);
+  String hpmode = (state.power == HP_POWER_ON) ? String(hpModeNames[state.mode].metric) : "0";
 
-  heatpumpSettings currentSettings = hp.getSettings();
-  heatpumpStatus currentStatus = hp.getStatus();
-
-  String hppower = (strcmp( currentSettings.power, "ON") == 0) ? "1" : "0";
-
-  String hpfan = currentSettings.fan;
-  if(hpfan == "AUTO") hpfan = "-1";
-  if(hpfan == "QUIET") hpfan = "0";
-
-  String hpvane = currentSettings.vane;
-  if(hpvane == "AUTO") hpvane = "-1";
-  if(hpvane == "SWING") hpvane = "0";
-
-  String hpwidevane = "-2";
-  if (strcmp(currentSettings.wideVane, "SWING")) hpwidevane = "0";
-  if (strcmp(currentSettings.wideVane, "<<")) hpwidevane =  "1";
-  if (strcmp(currentSettings.wideVane, "<")) hpwidevane = "2";
-  if (strcmp(currentSettings.wideVane, "|")) hpwidevane = "3";
-  if (strcmp(currentSettings.wideVane, ">")) hpwidevane = "4";
-  if (strcmp(currentSettings.wideVane, ">>")) hpwidevane = "5";
-  if (strcmp(currentSettings.wideVane, "<>")) hpwidevane = "6";
-
-  String hpmode = "-2";
-  if (strcmp(currentSettings.mode, "AUTO")) hpmode = "-1";
-  if (strcmp(currentSettings.mode, "COOL")) hpmode = "1";
-  if (strcmp(currentSettings.mode, "DRY")) hpmode = "2";
-  if (strcmp(currentSettings.mode, "HEAT")) hpmode = "3";
-  if (strcmp(currentSettings.mode, "FAN")) hpmode = "4";
-  if(hppower == "0") hpmode = "0";
-
-  metrics.replace("_UNIT_NAME_", hostname);
+  metrics.replace("_UNIT_NAME_", hostname.c_str());
   metrics.replace("_VERSION_", m2wifi_version);
   metrics.replace("_POWER_", hppower);
-  metrics.replace("_ROOMTEMP_", (String)currentStatus.roomTemperature);
-  metrics.replace("_TEMP_", (String)currentSettings.temperature);
+  metrics.replace("_ROOMTEMP_", (String)snapshot.roomTemperature);
+  metrics.replace("_TEMP_", (String)state.temperature);
   metrics.replace("_FAN_", hpfan);
   metrics.replace("_VANE_", hpvane);
   metrics.replace("_WIDEVANE_", hpwidevane);
   metrics.replace("_MODE_", hpmode);
-  metrics.replace("_OPER_", (String)currentStatus.operating);
-  metrics.replace("_COMPFREQ_", (String)currentStatus.compressorFrequency);
-
-  server.send(200, F("text/plain"), metrics);
+  metrics.replace("_OPER_", (String)snapshot.operating);
+  metrics.replace("_COMPFREQ_", (String)snapshot.compressorFrequency);
+  metrics.replace("_POLL_INTERVAL_", String(hpPollInterval));
+  metrics.replace("_POLL_RATE_", String(hpPollRate));
 
+  responseCache.send(request, CACHE_METRICS, version, configVersion, "text/plain", metrics, metricsLive);
 }
 
 //login page, also called for logout
-void handleLogin() {
+void handleLogin(AsyncWebServerRequest* request) {
   bool loginSuccess = false;
+  const char* cookie = nullptr;
   String msg;
   String loginPage =  FPSTR(html_page_login);
 
-  if (server.hasArg("USERNAME") || server.hasArg("PASSWORD") || server.hasArg("LOGOUT")) {
-    if (server.hasArg("LOGOUT")) {
+  if (request->hasArg("USERNAME") || request->hasArg("PASSWORD") || request->hasArg("LOGOUT")) {
+    if (request->hasArg("LOGOUT")) {
       //logout
-      server.sendHeader("Cache-Control", "no-cache");
-      server.sendHeader("Set-Cookie", "M2MSESSIONID=0");
+      cookie = "M2MSESSIONID=0";
       loginSuccess = false;
     }
-    if (server.hasArg("USERNAME") && server.hasArg("PASSWORD")) {
-      if (server.arg("USERNAME") == "admin" &&  server.arg("PASSWORD") == login_password) {
-        server.sendHeader("Cache-Control", "no-cache");
-        server.sendHeader("Set-Cookie", "M2MSESSIONID=1");
+    if (request->hasArg("USERNAME") && request->hasArg("PASSWORD")) {
+      if (request->arg("USERNAME") == "admin" &&  login_password == request->arg("PASSWORD")) {
+        cookie = "M2MSESSIONID=1";
         loginSuccess = true;
         msg = F("<span style='color:#47c266;font-weight:bold;'>");
         msg += FPSTR("Login successful, you will be redirected in a few seconds.");
@@ -1189,38 +1704,33 @@ void handleLogin() {
       }
     }
   } else {
-    if (is_authenticated() or login_password.length() == 0) {
-      server.sendHeader("Location", "/");
-      server.sendHeader("Cache-Control", "no-cache");
+    if (is_authenticated(request) or login_password.length() == 0) {
       //use javascript in the case browser disable redirect
-      String redirectPage = F("<html lang=\"en\" class=\"\"><head><meta charset='utf-8'>");
-      redirectPage += F("<script>");
-      redirectPage += F("setTimeout(function () {");
-      redirectPage += F("window.location.href= '/';");
-      redirectPage += F("}, 1000);");
-      redirectPage += F("</script>");
-      redirectPage += F("</body></html>");
-      server.send(302, F("text/html"), redirectPage);
+      sendRedirect(request, "/", true);
       return;
     }
   }
   loginPage.replace(F("_LOGIN_SUCCESS_"), (String) loginSuccess);
   loginPage.replace(F("_LOGIN_MSG_"), msg);
-  sendWrappedHTML(loginPage);
+  sendWrappedHTML(request, loginPage, cookie);
 }
 
-void handleUpgrade() {
-  if (!checkLogin()) return;
+void handleUpgrade(AsyncWebServerRequest* request) {
+  if (!checkLogin(request)) return;
 
   uploaderror = 0;
   String upgradePage = FPSTR(html_page_upgrade);
 
-  sendWrappedHTML(upgradePage);
+  sendWrappedHTML(request, upgradePage);
 }
 
-void handleUploadDone() {
+void handleUploadDone(AsyncWebServerRequest* request) {
+  if (!checkLogin(request)) return;
+
   //write_log(PSTR("HTTP: Firmware upload done"));
   bool restartflag = false;
+  // Nothing was received
+  if (!uploaderror && !Update.isFinished()) uploaderror = 1;
   String uploadDonePage = FPSTR(html_page_upload);
   String content = F("<div style='text-align:center;'><b>Upload ");
   if (uploaderror) {
@@ -1258,37 +1768,27 @@ void handleUploadDone() {
   }
   content += F("</div><br/>");
   uploadDonePage.replace("_UPLOAD_MSG_", content);
-  sendWrappedHTML(uploadDonePage);
+  sendWrappedHTML(request, uploadDonePage);
   if (restartflag) {
-    delay(500);
-#ifdef ESP32
-    ESP.restart();
-#else
-    ESP.reset();
-#endif
+    scheduleReboot(false);
   }
 }
 
-void handleUploadLoop() {
-  if (!checkLogin()) return;
+void handleUploadLoop(AsyncWebServerRequest* request, const String& filename, size_t index, uint8_t* data, size_t len, bool final) {
+  // handleUploadDone sends the login page
+  if (!is_authenticated(request) and login_password.length() > 0) return;
 
   // Based on ESP8266HTTPUpdateServer.cpp uses ESP8266WebServer Parsing.cpp and Cores Updater.cpp (Update)
   //char log[200];
-  if (uploaderror) {
-    Update.end();
-    return;
-  }
-  HTTPUpload& upload = server.upload();
-  if (upload.status == UPLOAD_FILE_START) {
-    if (upload.filename.c_str()[0] == 0)
+  if (index == 0) {
+    uploaderror = 0;
+    if (filename.c_str()[0] == 0)
     {
       uploaderror = 1;
       return;
     }
 
-    //save cpu by disconnect/stop network stuff ?
-
-    //snprintf_P(log, sizeof(log), PSTR("Upload: File %s ..."), upload.filename.c_str());
+    //snprintf_P(log, sizeof(log), PSTR("Upload: File %s ..."), filename.c_str());
     //write_log(log);
     uint32_t maxSketchSpace = (ESP.getFreeSketchSpace() - 0x1000) & 0xFFFFF000;
     if (!Update.begin(maxSketchSpace)) {         //start with max available size
@@ -1296,410 +1796,1225 @@ void handleUploadLoop() {
       uploaderror = 2;
       return;
     }
-  } else if (!uploaderror && (upload.status == UPLOAD_FILE_WRITE)) {
-    if (upload.totalSize == 0)
-    {
-      if (upload.buf[0] != 0xE9) {
-        //write_log(PSTR("Upload: File magic header does not start with 0xE9"));
-        uploaderror = 3;
-        return;
+    request->onDisconnect([]() {
+      if (!uploaderror && !Update.isFinished()) {
+        //write_log(PSTR("Upload: Update was aborted"));
+        uploaderror = 7;
+        Update.end();
       }
-      uint32_t bin_flash_size = ESP.magicFlashChipSize((upload.buf[3] & 0xf0) >> 4);
+    });
+
+    if (len < 4 || data[0] != 0xE9) {
+      //write_log(PSTR("Upload: File magic header does not start with 0xE9"));
+      uploaderror = 3;
+      Update.end();
+      return;
+    }
+    uint32_t bin_flash_size = ESP.magicFlashChipSize((data[3] & 0xf0) >> 4);
 
 #ifdef ESP32
-      if (bin_flash_size > ESP.getFlashChipSize()) {
+    if (bin_flash_size > ESP.getFlashChipSize()) {
 #else
-      if (bin_flash_size > ESP.getFlashChipRealSize()) {
+    if (bin_flash_size > ESP.getFlashChipRealSize()) {
 #endif
-        //write_log(PSTR("Upload: File flash size is larger than device flash size"));
-        uploaderror = 4;
-        return;
-      }
-      if (ESP.getFlashChipMode() == 3) {
-        upload.buf[2] = 3; // DOUT - ESP8285
-      } else {
-        upload.buf[2] = 2; // DIO - ESP8266
-      }
-    }
-    if (!uploaderror && (Update.write(upload.buf, upload.currentSize) != upload.currentSize)) {
-      //Update.printError(Serial);
-      uploaderror = 5;
+      //write_log(PSTR("Upload: File flash size is larger than device flash size"));
+      uploaderror = 4;
+      Update.end();
       return;
     }
-  } else if (!uploaderror && (upload.status == UPLOAD_FILE_END)) {
+    if (ESP.getFlashChipMode() == 3) {
+      data[2] = 3; // DOUT - ESP8285
+    } else {
+      data[2] = 2; // DIO - ESP8266
+    }
+  }
+  if (uploaderror) return;
+
+  if (Update.write(data, len) != len) {
+    //Update.printError(Serial);
+    uploaderror = 5;
+    Update.end();
+    return;
+  }
+  if (final) {
     if (Update.end(true)) { // true to set the size to the current progress
-      //snprintf_P(log, sizeof(log), PSTR("Upload: Successful %u bytes. Restarting"), upload.totalSize);
+      //snprintf_P(log, sizeof(log), PSTR("Upload: Successful %u bytes. Restarting"), index + len);
       //write_log(log)
     } else {
       //Update.printError(Serial);
       uploaderror = 6;
-      return;
     }
-  } else if (upload.status == UPLOAD_FILE_ABORTED) {
-    //write_log(PSTR("Upload: Update was aborted"));
-    uploaderror = 7;
-    Update.end();
   }
-  delay(0);
 }
 
 void write_log(String log) {
   //File logFile = SPIFFS.open(console_file, "a");
   //logFile.println(log);
   //logFile.close();
-  if (!hp.isConnected())
+  // The wifi is now connected in background, don't write on the HVAC line
+  if (serialLogs && !hpRead().connected)
   {
     Serial.println(log);
   }
 }
 
+// CN105 side, publish the unit state when it changed
+void hpPublish() {
+  HpSnapshot snapshot;
+  heatpumpStatus status = hp.getStatus();
+  snapshot.connected = hp.isConnected();
+  snapshot.settings = hpStateFrom(hp.getSettings());
+  snapshot.roomTemperature = status.roomTemperature;
+  snapshot.compressorFrequency = status.compressorFrequency;
+  snapshot.operating = status.operating;
+
+  if (!(snapshot == hpPublished)) {
+    hpPublished = snapshot;
+    hpSnapshot.write(snapshot);
+  }
+}
+
+// Any side, consistent copy of the last published state
+HpSnapshot hpRead(uint32_t* version) {
+  HpSnapshot snapshot;
+  uint32_t v = hpSnapshot.read(snapshot);
+  if (version) *version = v;
+  return snapshot;
+}
+
+// Library callbacks, on the CN105 side. They only fill events for loop().
 void hpSettingsChanged() {
+  hpActivityAt = millis();
+  hpPublish();
 
   if (millis() - hp.getLastWanted() < PREVENT_UPDATE_INTERVAL_MS) // prevent application setting change after send update interval we wait for 1 seconds before udpate data
   {
     return;
   }
 
-  // send room temp, operating info and all information
-  heatpumpSettings currentSettings = hp.getSettings();
-
-  //rootInfo.clear();
-  rootInfo["temperature"]     = convertCelsiusToLocalUnit(currentSettings.temperature, useFahrenheit);
-  rootInfo["fan"]             = currentSettings.fan;
-  rootInfo["vane"]            = currentSettings.vane;
-  rootInfo["widevane"]        = currentSettings.wideVane;
-  rootInfo["mode"]            = currentSettings.mode;
-  rootInfo["power"]           = currentSettings.power;
-
-  SendJson(rootInfo);
-
-  //hpStatusChanged(hp.getStatus());
+  HpEvent event;
+  event.type = HP_EVENT_SETTINGS;
+  event.settings = hpPublished.settings;
+  hpBus.publish(event);
 }
 
 void hpStatusChanged(heatpumpStatus currentStatus) {
+  hpPublish();
+
+  // A ramping compressor keeps the polling fast
+  if (currentStatus.compressorFrequency != hpLastCompressorFrequency) {
+    hpLastCompressorFrequency = currentStatus.compressorFrequency;
+    hpActivityAt = millis();
+  }
 
   if (millis() - hp.getLastWanted() < PREVENT_UPDATE_INTERVAL_MS) // prevent application setting change after send update interval we wait for 1 seconds before udpate data
   {
     return;
   }
 
-  if (millis() - lastTempSend > SEND_ROOM_TEMP_INTERVAL_MS)
-  {
-    // only send the temperature every SEND_ROOM_TEMP_INTERVAL_MS (millis rollover tolerant)
-    hpCheckRemoteTemp(); // if the remote temperature feed from mqtt is stale, disable it and revert to the internal thermometer.
+  HpEvent event;
+  event.type = HP_EVENT_STATUS;
+  event.roomTemperature = currentStatus.roomTemperature;
+  event.compressorFrequency = currentStatus.compressorFrequency;
+  event.operating = currentStatus.operating;
+  hpBus.publish(event);
+}
 
-    // send room temp, operating info and all information
-    //heatpumpSettings currentSettings = hp.getSettings();
+void hpPacketDebug(byte* packet, unsigned int length, const char* packetDirection) {
+  if (_debugModePckts) {
+    HpEvent event;
+    event.type = HP_EVENT_PACKET;
+    event.direction = packetDirection;
+    event.length = min(length, (unsigned int)HP_EVENT_PACKET_SIZE);
+    memcpy(event.packet, packet, event.length);
+    hpBus.publish(event);
+  }
+}
 
-    if (currentStatus.roomTemperature == 0) return;
+// Web/network side, queue a request for the CN105 side
+bool hpCommand(HpCommandType type, uint8_t value, float temperature) {
+  return hpQueueCommand(hpCommands, type, value, temperature);
+}
 
-    //rootInfo.clear();
-    rootInfo["roomTemperature"]     = convertCelsiusToLocalUnit(currentStatus.roomTemperature, useFahrenheit);
-    rootInfo["compressorFrequency"] = currentStatus.compressorFrequency;
-    rootInfo["action"]              = currentStatus.operating;
-/*
-    rootInfo["temperature"]         = convertCelsiusToLocalUnit(currentSettings.temperature, useFahrenheit);
-    rootInfo["fan"]                 = currentSettings.fan;
-    rootInfo["vane"]                = currentSettings.vane;
-    rootInfo["widevane"]            = currentSettings.wideVane;
-    rootInfo["mode"]                = currentSettings.mode;
-    rootInfo["power"]               = currentSettings.power;
-*/
+// Any producer, each queue has its own
+bool hpQueueCommand(HpCommandQueue& queue, HpCommandType type, uint8_t value, float temperature) {
+  HpCommand command;
+  command.type = type;
+  command.value = value;
+  command.temperature = temperature;
+  return queue.push(command);
+}
+
+// CN105 side
+void hpExecute(const HpCommand& command) {
+  switch (command.type) {
+    case HP_CMD_POWER:
+      hp.setPowerSetting(command.value == HP_POWER_ON);
+      break;
+    case HP_CMD_MODE:
+      hp.setModeSetting(hpModeNames[command.value].name);
+      break;
+    case HP_CMD_FAN:
+      hp.setFanSpeed(hpFanNames[command.value].name);
+      break;
+    case HP_CMD_VANE:
+      hp.setVaneSetting(hpVaneNames[command.value].name);
+      break;
+    case HP_CMD_WIDEVANE:
+      hp.setWideVaneSetting(hpWideVaneNames[command.value].name);
+      break;
+    case HP_CMD_TEMPERATURE:
+      hp.setTemperature(command.temperature);
+      break;
+    case HP_CMD_REMOTE_TEMP:
+      hp.setRemoteTemperature(command.temperature);
+      break;
+    case HP_CMD_CONNECT:
+      hp.connect(&Serial);
+      break;
+    case HP_CMD_REFRESH:
+      hpSettingsChanged();
+      break;
+  }
+  // The settings are only sent by the next sync, do it on this service pass and poll fast after
+  hpActivityAt = millis();
+  lastHpPoll = 0;
+
+  HpEvent event;
+  event.type = HP_EVENT_COMMAND;
+  event.command = command;
+  hpBus.publish(event);
+}
+
+// Everything touching the CN105 link: queued commands, connection retries and polling
+void hpService() {
+  HpCommand command;
+  while (hpCommands.pop(command)) {
+    hpExecute(command);
+  }
+  while (webCommands.pop(command)) {
+    hpExecute(command);
+  }
+#ifdef USE_MQTT
+  while (mqttCommands.pop(command)) {
+    hpExecute(command);
+  }
+#endif
+
+  bool connected = hp.isConnected();
+  if (connected != hpWasConnected) {
+    hpWasConnected = connected;
+    hpPublish();
+    hpPublishEvent(connected ? HP_EVENT_CONNECTED : HP_EVENT_DISCONNECTED);
+  }
 
-    SendJson(rootInfo);
+  if (!hp.isConnected())
+  {
+    // Use exponential backoff for retries, where each retry is double the length of the previous one.
+    unsigned long durationNextSync = (1 << hpConnectionRetries) * HP_RETRY_INTERVAL_MS;
+    if (((millis() - lastHpSync > durationNextSync) or lastHpSync == 0))
+    {
+      lastHpSync = millis();
+      // If we've retried more than the max number of tries, keep retrying at that fixed interval, which is several minutes.
+      hpConnectionRetries = min(hpConnectionRetries + 1u, HP_MAX_RETRIES);
+      hpConnectionTotalRetries++;
+      hp.sync();
+    }
+  }
+  else
+  {
+    hpConnectionRetries = 0;
+    hpPoll();
+  }
+}
 
-    lastTempSend = millis();
+#ifdef HP_TASK
+void hpTask(void* parameter) {
+  for (;;) {
+    hpService();
+    vTaskDelay(pdMS_TO_TICKS(HP_TASK_PERIOD_MS));
   }
 }
+#endif
+
+// Push subscriber, send the changes to server_url
+void hpPushEvent(const HpEvent& event) {
+  switch (event.type) {
+    case HP_EVENT_SETTINGS: {
+      HeapScope scope("hpSettingsChanged");
+      if (event.settings.power != HP_POWER_UNKNOWN) bootMark(BOOT_HP_SYNC);
+
+      //rootInfo.clear();
+      rootInfo["temperature"]     = convertCelsiusToLocalUnit(event.settings.temperature, useFahrenheit);
+      rootInfo["fan"]             = hpFanNames[event.settings.fan].name;
+      rootInfo["vane"]            = hpVaneNames[event.settings.vane].name;
+      rootInfo["widevane"]        = hpWideVaneNames[event.settings.wideVane].name;
+      rootInfo["mode"]            = hpModeNames[event.settings.mode].name;
+      rootInfo["power"]           = hpPowerNames[event.settings.power].name;
+      SendJson(rootInfo);
+      break;
+    }
+    case HP_EVENT_STATUS: {
+      // only send the temperature every SEND_ROOM_TEMP_INTERVAL_MS (millis rollover tolerant)
+      if (event.roomTemperature == 0 || millis() - lastTempSend <= SEND_ROOM_TEMP_INTERVAL_MS) break;
+      lastTempSend = millis();
+
+      HeapScope scope("hpStatusChanged");
+      rootInfo["roomTemperature"]     = convertCelsiusToLocalUnit(event.roomTemperature, useFahrenheit);
+      rootInfo["compressorFrequency"] = event.compressorFrequency;
+      rootInfo["action"]              = event.operating;
+      SendJson(rootInfo);
+      break;
+    }
+    case HP_EVENT_PACKET: {
+      HeapScope scope("hpPacketDebug");
+      char message[HP_EVENT_PACKET_SIZE * 3 + 1];
+      packetToHex(event.packet, event.length, message);
+
+      const size_t bufferSize = JSON_OBJECT_SIZE(10);
+      StaticJsonDocument<bufferSize> root;
+
+      // Kept as a pointer by the document, the buffer outlives SendJson()
+      root[event.direction] = (const char*)message;
+      SendJson(root);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// CN105 side, events without payload
+void hpPublishEvent(HpEventType type) {
+  HpEvent event;
+  event.type = type;
+  hpBus.publish(event);
+}
 
 void hpCheckRemoteTemp(){
     if (remoteTempActive && (millis() - lastRemoteTemp > CHECK_REMOTE_TEMP_INTERVAL_MS)) {
      //if it's been 5 minutes since last remote_temp message, revert back to HP internal temp sensor
      remoteTempActive = false;
-     float temperature = 0;
-     hp.setRemoteTemperature(temperature);
-     hp.update();
+     remoteTempSent = NAN;
+     hpCommand(HP_CMD_REMOTE_TEMP, 0, 0.0);
     }
 }
 
+// Poll the unit every hp_poll_fast_ms after a command or while the compressor ramps,
+// every hp_poll_slow_ms when idle. A reply waiting on the serial port is always read.
+void hpPoll() {
+  unsigned long now = millis();
+  bool active = now - hp.getLastWanted() < HP_POLL_ACTIVE_MS || now - hpActivityAt < HP_POLL_ACTIVE_MS;
+  hpPollInterval = active ? hp_poll_fast_ms : hp_poll_slow_ms;
 
-void hpPacketDebug(byte* packet, unsigned int length, const char* packetDirection) {
-  if (_debugModePckts) {
-    String message;
-    for (unsigned int idx = 0; idx < length; idx++) {
-      if (packet[idx] < 16) {
-        message += "0"; // pad single hex digits with a 0
-      }
-      message += String(packet[idx], HEX) + " ";
+  if (now - lastHpPoll >= hpPollInterval) {
+    lastHpPoll = now;
+    hpPollCount++;
+    hp.sync();
+  }
+  else if (Serial.available() > 0) {
+    hp.sync();
+  }
+
+  if (now - hpPollRateSince >= 60000) {
+    hpPollRate = hpPollCount;
+    hpPollCount = 0;
+    hpPollRateSince = now;
+  }
+}
+
+// Room temperature from an external sensor, in the local unit. 0 gives control back to the unit sensor.
+// Readings are smoothed and only forwarded when they move more than the deadband, or after
+// REMOTE_TEMP_MAX_INTERVAL_MS, to keep the CN105 link free.
+void remoteTempReading(float temperature) {
+  if (temperature == 0) {
+    if (remoteTempActive) {
+      remoteTempActive = false;
+      remoteTempSent = NAN;
+      hpCommand(HP_CMD_REMOTE_TEMP, 0, 0.0);
     }
+    return;
+  }
 
-    const size_t bufferSize = JSON_OBJECT_SIZE(10);
-    StaticJsonDocument<bufferSize> root;
+  // A measure keeps its decimals, the remote table is only for setpoints
+  float celsius = useFahrenheit ? fahrenheitToCelsius(temperature) : temperature;
+  if (isnan(celsius) || celsius < REMOTE_TEMP_MIN || celsius > REMOTE_TEMP_MAX) return;
 
-    root[packetDirection] = message;
-    SendJson(root);
+  if (remoteTempActive) {
+    remoteTempFiltered += REMOTE_TEMP_FILTER_WEIGHT * (celsius - remoteTempFiltered);
+  }
+  else {
+    remoteTempFiltered = celsius;
+  }
+  remoteTempActive = true;
+  lastRemoteTemp = millis();
+
+  if (isnan(remoteTempSent) || fabsf(remoteTempFiltered - remoteTempSent) >= REMOTE_TEMP_DEADBAND ||
+      millis() - remoteTempSentAt >= REMOTE_TEMP_MAX_INTERVAL_MS) {
+    if (!hpCommand(HP_CMD_REMOTE_TEMP, 0, remoteTempFiltered)) return;
+    remoteTempSent = remoteTempFiltered;
+    remoteTempSentAt = millis();
   }
 }
 
+// Datagrams are plain text, "21.5" or "password:21.5" when a login password is set
+void remoteTempUdpLoop() {
+  // Readings posted to /json, handled here as the filter state belongs to loop()
+  float reading;
+  while (webRemoteTemps.pop(reading)) {
+    remoteTempReading(reading);
+  }
 
-#if 0
-void mqttCallback(char* topic, byte* payload, unsigned int length) {
-
-  // Copy payload into message buffer
-  char message[length + 1];
-  for (unsigned int i = 0; i < length; i++) {
-    message[i] = (char)payload[i];
-  }
-  message[length] = '\0';
-
-  // HA topics
-  // Receive power topic
-  if (strcmp(topic, ha_mode_set_topic.c_str()) == 0) {
-    String modeUpper = message;
-    modeUpper.toUpperCase();
-    if (modeUpper == "OFF") {
-      rootInfo["mode"] = "off";
-      rootInfo["action"] = "off";
-      hpSendLocalState();
-      hp.setPowerSetting("OFF");
-    } else {
-      if (modeUpper == "HEAT_COOL") {
-        rootInfo["mode"] = "heat_cool";
-        rootInfo["action"] = "idle";
-        modeUpper = "AUTO";
-      } else if (modeUpper == "HEAT") {
-        rootInfo["mode"] = "heat";
-        rootInfo["action"] = "heating";
-      } else if (modeUpper == "COOL") {
-        rootInfo["mode"] = "cool";
-        rootInfo["action"] = "cooling";
-      } else if (modeUpper == "DRY") {
-        rootInfo["mode"] = "dry";
-        rootInfo["action"] = "drying";
-      } else if (modeUpper == "FAN_ONLY") {
-        rootInfo["mode"] = "fan_only";
-        rootInfo["action"] = "fan";
-        modeUpper = "FAN";
-      } else {
+  int size = remoteTempUdp.parsePacket();
+  if (size <= 0) return;
+
+  char packet[48];
+  int len = remoteTempUdp.read(packet, sizeof(packet) - 1);
+  remoteTempUdp.flush();
+  if (len <= 0) return;
+  packet[len] = '\0';
+
+  char* value = packet;
+  if (login_password.length() > 0) {
+    char* sep = strrchr(packet, ':');
+    if (sep == nullptr) return;
+    *sep = '\0';
+    if (login_password != packet) return;
+    value = sep + 1;
+  }
+
+  char* end;
+  float temperature = strtof(value, &end);
+  if (end == value) return;
+  remoteTempReading(temperature);
+}
+
+
+// Multicast announcer, one datagram for each new state and a heartbeat every MCAST_HEARTBEAT_MS.
+// 26 bytes, little endian:
+//   0  "M2W" and format version 1
+//   4  sequence number, uint32
+//   8  device id, the wifi MAC address
+//  14  flags: 1 connected, 2 operating, 4 heartbeat
+//  15  power, mode, fan, vane, widevane as indexes of the hpstate.h tables
+//  20  target temperature, Celsius x10, int16
+//  22  room temperature, Celsius x10, int16
+//  24  compressor frequency, uint16
+#define MCAST_PACKET_SIZE 26
+
+// Event bus subscriber, only remember something changed
+void mcastEvent(const HpEvent& event) {
+  mcastDirty = true;
+}
+
+static void putUint16(uint8_t* p, uint16_t value) {
+  p[0] = value & 0xFF;
+  p[1] = value >> 8;
+}
+
+void mcastLoop() {
+  if (mcast_group == 0 || WiFi.status() != WL_CONNECTED) return;
+
+  bool heartbeat = millis() - mcastLastSend >= MCAST_HEARTBEAT_MS;
+  if (!mcastDirty && !heartbeat) return;
+  mcastDirty = false;
+
+  uint32_t version;
+  HpSnapshot snapshot = hpRead(&version);
+  if (!heartbeat && version == mcastSentVersion) return;
+
+  uint8_t packet[MCAST_PACKET_SIZE];
+  packet[0] = 'M';
+  packet[1] = '2';
+  packet[2] = 'W';
+  packet[3] = 1;
+  mcastSequence++;
+  putUint16(packet + 4, mcastSequence & 0xFFFF);
+  putUint16(packet + 6, mcastSequence >> 16);
+  WiFi.macAddress(packet + 8);
+  packet[14] = (snapshot.connected ? 1 : 0) | (snapshot.operating ? 2 : 0) | (heartbeat ? 4 : 0);
+  packet[15] = snapshot.settings.power;
+  packet[16] = snapshot.settings.mode;
+  packet[17] = snapshot.settings.fan;
+  packet[18] = snapshot.settings.vane;
+  packet[19] = snapshot.settings.wideVane;
+  putUint16(packet + 20, (int16_t)lroundf(snapshot.settings.temperature * 10));
+  putUint16(packet + 22, (int16_t)lroundf(snapshot.roomTemperature * 10));
+  putUint16(packet + 24, snapshot.compressorFrequency);
+
+#ifdef ESP32
+  mcastUdp.beginPacket(IPAddress(mcast_group), mcast_port);
+#else
+  mcastUdp.beginPacketMulticast(IPAddress(mcast_group), mcast_port, WiFi.localIP());
+#endif
+  mcastUdp.write(packet, sizeof(packet));
+  mcastUdp.endPacket();
+
+  mcastSentVersion = version;
+  mcastLastSend = millis();
+}
+
+// Webhook subscriptions. The bus subscriber records which fields changed, each target
+// then gets the current value of its fields, so changes queued during a backoff are
+// coalesced into one request. Each target has its own asynchronous connection: loop()
+// only starts a request and collects its result, a slow or silent target never delays
+// the others, and a failing one backs off exponentially.
+const char* const subFieldNames[] = {
+  "temperature", "fan", "vane", "widevane", "mode", "power",   // settings
+  "roomTemperature", "compressorFrequency", "action"          // status
+};
+#define SUB_FIELD_COUNT (sizeof(subFieldNames) / sizeof(subFieldNames[0]))
+#define SUB_FIELDS_ALL ((1 << SUB_FIELD_COUNT) - 1)
+
+struct SubscriptionState {
+  uint16_t pending;               // changed fields not delivered yet
+  uint16_t sending;               // fields of the request in flight
+  uint8_t generation;             // bumped when the slot changes target
+  bool attempted;
+  unsigned long lastAttempt;
+  uint32_t retryDelay;            // 0 while the target answers
+  uint32_t delivered;
+  uint32_t failed;
+};
+SubscriptionState subState[SUBSCRIPTION_MAX];
+
+// Request in flight of a slot. loop() fills it while idle then hands it to the network
+// task, which owns it until the phase says done.
+enum SubscriptionPhase : uint8_t { SUB_IDLE, SUB_SENDING, SUB_DONE };
+struct SubscriptionDelivery {
+  std::atomic<uint8_t> phase{SUB_IDLE};
+  uint8_t generation;
+  String request;
+  unsigned long started;
+  int status;                     // HTTP status, 0 without an answer yet
+};
+SubscriptionDelivery subDelivery[SUBSCRIPTION_MAX];
+// Changes posted to /subscriptions, applied by loop() which owns the table
+struct SubscriptionChange {
+  int8_t slot;                    // -1 to add or update by url
+  SubscriptionRecord record;      // empty url to remove the slot
+};
+SpscQueue<SubscriptionChange, 2> subChanges;
+// Last values seen on the bus, unknown at first so the first events mark every field
+HpSnapshot subLast = {false, {HP_POWER_UNKNOWN, HP_MODE_UNKNOWN, HP_FAN_UNKNOWN, HP_VANE_UNKNOWN, HP_WIDEVANE_UNKNOWN, NAN},
+                      NAN, -1, false};
+
+// Event bus subscriber, mark the changed fields on every target filtering them
+void subEvent(const HpEvent& event) {
+  uint16_t changed = 0;
+  if (event.type == HP_EVENT_SETTINGS) {
+    const HpState& s = event.settings;
+    if (s.temperature != subLast.settings.temperature) changed |= 1 << 0;
+    if (s.fan != subLast.settings.fan) changed |= 1 << 1;
+    if (s.vane != subLast.settings.vane) changed |= 1 << 2;
+    if (s.wideVane != subLast.settings.wideVane) changed |= 1 << 3;
+    if (s.mode != subLast.settings.mode) changed |= 1 << 4;
+    if (s.power != subLast.settings.power) changed |= 1 << 5;
+    subLast.settings = s;
+  }
+  else {
+    if (event.roomTemperature != subLast.roomTemperature) changed |= 1 << 6;
+    if (event.compressorFrequency != subLast.compressorFrequency) changed |= 1 << 7;
+    if (event.operating != subLast.operating) changed |= 1 << 8;
+    subLast.roomTemperature = event.roomTemperature;
+    subLast.compressorFrequency = event.compressorFrequency;
+    subLast.operating = event.operating;
+  }
+
+  for (uint8_t i = 0; i < SUBSCRIPTION_MAX; i++) {
+    if (!subscriptions[i].url.isEmpty()) subState[i].pending |= changed & subscriptions[i].fields;
+  }
+}
+
+// Forget the delivery state of a slot, a new target gets the current values right away
+void subReset(uint8_t index) {
+  uint8_t generation = subState[index].generation + 1;
+  subState[index] = {};
+  subState[index].generation = generation;   // a request in flight for the old target is ignored
+  subState[index].pending = subscriptions[index].fields;
+}
+
+void subApply(const SubscriptionChange& change) {
+  int slot = change.slot;
+  // Same url updates its slot, otherwise take a free one
+  for (uint8_t i = 0; i < SUBSCRIPTION_MAX && slot < 0; i++) {
+    if (subscriptions[i].url == change.record.url.c_str()) slot = i;
+  }
+  for (uint8_t i = 0; i < SUBSCRIPTION_MAX && slot < 0; i++) {
+    if (subscriptions[i].url.isEmpty()) slot = i;
+  }
+  if (slot < 0) return;
+
+  ConfigGuard guard;
+  subscriptions[slot] = change.record;
+  subReset(slot);
+  saveConfig();
+}
+
+void subLoop() {
+  SubscriptionChange change;
+  while (subChanges.pop(change)) {
+    subApply(change);
+  }
+
+  for (uint8_t i = 0; i < SUBSCRIPTION_MAX; i++) {
+    if (subDelivery[i].phase.load(std::memory_order_acquire) == SUB_DONE) subFinish(i);
+  }
+
+  if (WiFi.status() != WL_CONNECTED) return;
+
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < SUBSCRIPTION_MAX; i++) {
+    SubscriptionState& state = subState[i];
+    if (subscriptions[i].url.isEmpty() || state.pending == 0) continue;
+    if (subDelivery[i].phase.load(std::memory_order_acquire) != SUB_IDLE) continue;
+
+    uint32_t wait = max(state.retryDelay, subscriptions[i].interval_ms);
+    if (state.attempted && now - state.lastAttempt < wait) continue;
+
+    subDeliver(i);
+  }
+}
+
+// Split http://host[:port][/path], the host part is kept as given for the Host header
+bool subParseUrl(const char* url, String& host, uint16_t& port, String& hostHeader, String& path) {
+  if (strncmp(url, "http://", 7) != 0) return false;
+  const char* authority = url + 7;
+  const char* slash = strchr(authority, '/');
+  hostHeader = slash ? String(authority).substring(0, slash - authority) : String(authority);
+  path = slash ? slash : "/";
+  int colon = hostHeader.indexOf(':');
+  host = colon < 0 ? hostHeader : hostHeader.substring(0, colon);
+  port = colon < 0 ? 80 : hostHeader.substring(colon + 1).toInt();
+  return !host.isEmpty() && port != 0;
+}
+
+void subDeliver(uint8_t index) {
+  HeapScope scope("subscriptions");
+  SubscriptionRecord& sub = subscriptions[index];
+  SubscriptionState& state = subState[index];
+  SubscriptionDelivery& delivery = subDelivery[index];
+
+  HpSnapshot snapshot = hpRead();
+  StaticJsonDocument<JSON_OBJECT_SIZE(SUB_FIELD_COUNT)> doc;
+  const uint16_t fields = sub.fields;
+  if (fields & (1 << 0)) doc[subFieldNames[0]] = convertCelsiusToLocalUnit(snapshot.settings.temperature, useFahrenheit);
+  if (fields & (1 << 1)) doc[subFieldNames[1]] = hpFanNames[snapshot.settings.fan].name;
+  if (fields & (1 << 2)) doc[subFieldNames[2]] = hpVaneNames[snapshot.settings.vane].name;
+  if (fields & (1 << 3)) doc[subFieldNames[3]] = hpWideVaneNames[snapshot.settings.wideVane].name;
+  if (fields & (1 << 4)) doc[subFieldNames[4]] = hpModeNames[snapshot.settings.mode].name;
+  if (fields & (1 << 5)) doc[subFieldNames[5]] = hpPowerNames[snapshot.settings.power].name;
+  if (fields & (1 << 6)) doc[subFieldNames[6]] = convertCelsiusToLocalUnit(snapshot.roomTemperature, useFahrenheit);
+  if (fields & (1 << 7)) doc[subFieldNames[7]] = snapshot.compressorFrequency;
+  if (fields & (1 << 8)) doc[subFieldNames[8]] = snapshot.operating;
+  String body;
+  serializeJson(doc, body);
+
+  state.sending = state.pending;
+  state.pending = 0;
+  state.attempted = true;
+  state.lastAttempt = millis();
+
+  String host, hostHeader, path;
+  uint16_t port;
+  if (!subParseUrl(sub.url.c_str(), host, port, hostHeader, path)) {
+    delivery.status = 0;
+    delivery.generation = state.generation;
+    delivery.phase.store(SUB_DONE, std::memory_order_release);
+    return;
+  }
+
+  delivery.request = "POST " + path + " HTTP/1.1\r\nHost: " + hostHeader +
+                     "\r\nContent-Type: application/json\r\nContent-Length: " + String(body.length()) +
+                     "\r\nConnection: close\r\n\r\n" + body;
+  delivery.generation = state.generation;
+  delivery.started = state.lastAttempt;
+  delivery.status = 0;
+  delivery.phase.store(SUB_SENDING, std::memory_order_release);
+
+  // From here the delivery belongs to the network task, the client deletes itself once closed
+  AsyncClient* client = new AsyncClient();
+  SubscriptionDelivery* d = &delivery;
+  client->onConnect([d](void*, AsyncClient* c) {
+    c->write(d->request.c_str(), d->request.length());
+  });
+  client->onData([d](void*, AsyncClient*, void* data, size_t len) {
+    // "HTTP/1.1 204 ...", the status line is all we need. The client can't be closed
+    // from here as it is deleted on disconnect, the next poll does it.
+    if (d->status == 0 && len > 12) {
+      const char* line = (const char*)data;
+      d->status = strncmp(line, "HTTP/1.", 7) == 0 ? atoi(line + 9) : -1;
+    }
+  });
+  client->onPoll([d](void*, AsyncClient* c) {
+    if (d->status != 0 || millis() - d->started > SUB_TIMEOUT_MS) c->close(true);
+  });
+  client->onDisconnect([d](void*, AsyncClient* c) {
+    d->phase.store(SUB_DONE, std::memory_order_release);
+    delete c;
+  });
+  if (!client->connect(host.c_str(), port)) {
+    delete client;
+    delivery.phase.store(SUB_DONE, std::memory_order_release);
+  }
+}
+
+// Result of the last request of a slot, back on loop()
+void subFinish(uint8_t index) {
+  SubscriptionState& state = subState[index];
+  SubscriptionDelivery& delivery = subDelivery[index];
+  bool ok = delivery.status >= 200 && delivery.status < 300;
+  bool current = delivery.generation == state.generation;
+  delivery.request = String();
+  delivery.phase.store(SUB_IDLE, std::memory_order_relaxed);
+  if (!current) return;
+
+  if (ok) {
+    state.retryDelay = 0;
+    state.delivered++;
+  }
+  else {
+    state.pending |= state.sending;
+    state.retryDelay = state.retryDelay ? min(state.retryDelay * 2, SUB_BACKOFF_MAX_MS) : SUB_BACKOFF_MIN_MS;
+    state.failed++;
+  }
+  state.sending = 0;
+}
+
+// Consistent copy of the subscriptions for the network task
+void subCopy(SubscriptionRecord* out) {
+  ConfigGuard guard;
+  for (uint8_t i = 0; i < SUBSCRIPTION_MAX; i++) {
+    out[i] = subscriptions[i];
+  }
+}
+
+// GET lists the subscriptions, POST {"url", "fields": [...], "interval": ms} adds or updates one,
+// DELETE ?id= removes one. Same password as /json, "pass" in the body or the query.
+// Changes are applied by loop(), a following GET shows them.
+void handleSubscriptions(AsyncWebServerRequest* request) {
+  const char* body;
+  size_t length;
+
+  if (request->method() == HTTP_POST || request->method() == HTTP_DELETE) {
+    uint32_t retryAfter = rateLimiter.admit(clientIp(request), RATE_SUBSCRIPTIONS);
+    if (retryAfter) {
+      sendJsonReturn(request, "Too many requests", false, 429, retryAfter);
+      return;
+    }
+  }
+
+  // loop() owns the table, work on a copy
+  SubscriptionRecord subs[SUBSCRIPTION_MAX];
+  subCopy(subs);
+
+  if (request->method() == HTTP_POST) {
+    if (requestTooLarge(request)) {
+      sendJsonReturn(request, "Request too large", false, 413);
+      return;
+    }
+    StaticJsonDocument<JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(SUB_FIELD_COUNT) + 200> doc;
+    if (!requestBody(request, body, length) || deserializeJson(doc, body, length)) {
+      sendJsonReturn(request, "Bad request", false);
+      return;
+    }
+    if (login_password.length() > 0 && login_password != doc["pass"].as<const char*>()) {
+      sendJsonReturn(request, "Bad password", false);
+      return;
+    }
+
+    const char* url = doc["url"];
+    if (url == nullptr || strncmp(url, "http://", 7) != 0 || strlen(url) > 128) {
+      sendJsonReturn(request, "Bad url", false);
+      return;
+    }
+    uint16_t fields = SUB_FIELDS_ALL;
+    if (doc.containsKey("fields")) {
+      fields = 0;
+      for (JsonVariant field : doc["fields"].as<JsonArray>()) {
+        for (uint8_t f = 0; f < SUB_FIELD_COUNT; f++) {
+          if (field == subFieldNames[f]) fields |= 1 << f;
+        }
+      }
+      if (fields == 0) {
+        sendJsonReturn(request, "Bad fields", false);
         return;
       }
-      hpSendLocalState();
-      hp.setPowerSetting("ON");
-      hp.setModeSetting(modeUpper.c_str());
     }
-  }
-  else if (strcmp(topic, ha_temp_set_topic.c_str()) == 0) {
-    float temperature = strtof(message, NULL);
-    float temperature_c = convertLocalUnitToCelsius(temperature, useFahrenheit);
-    if (temperature_c < min_temp || temperature_c > max_temp) {
-      temperature_c = 23;
-      rootInfo["temperature"] = convertCelsiusToLocalUnit(temperature_c, useFahrenheit);
-    } else {
-      rootInfo["temperature"] = temperature;
-    }
-    hpSendLocalState();
-    hp.setTemperature(temperature_c);
-  }
-  else if (strcmp(topic, ha_fan_set_topic.c_str()) == 0) {
-    String fanUpper = message;
-    fanUpper.toUpperCase();
-    String fanSpeed = fanUpper;
-    if (fanUpper == "DIFFUSE") {
-      fanSpeed = "QUIET";
-    } else if (fanUpper == "LOW") {
-      fanSpeed = "1";
-    } else if (fanUpper == "MIDDLE") {
-      fanSpeed = "2";
-    } else if (fanUpper == "MEDIUM") {
-      fanSpeed = "3";
-    } else if (fanUpper == "HIGH") {
-      fanSpeed = "4";
-    }
-    rootInfo["fan"] = (String) message;
-    hpSendLocalState();
-    hp.setFanSpeed(fanSpeed.c_str());
-  }
-  else if (strcmp(topic, ha_vane_set_topic.c_str()) == 0) {
-    rootInfo["vane"] = (String) message;
-    hpSendLocalState();
-    hp.setVaneSetting(message);
-  }
-  else if (strcmp(topic, ha_wideVane_set_topic.c_str()) == 0) {
-    rootInfo["widevane"] = (String) message;
-    hpSendLocalState();
-    hp.setWideVaneSetting(message);
-  }
-  else if (strcmp(topic, ha_remote_temp_set_topic.c_str()) == 0) {
-    float temperature = strtof(message, NULL);
-    if (temperature == 0){ //Remote temp disabled by mqtt topic set
-      remoteTempActive = false; //clear the remote temp flag
-      hp.setRemoteTemperature(0.0);
+
+    bool found = false;
+    for (uint8_t i = 0; i < SUBSCRIPTION_MAX && !found; i++) {
+      found = subs[i].url == url || subs[i].url.isEmpty();
     }
-    else {
-      remoteTempActive = true; //Remote temp has been pushed.
-      lastRemoteTemp = millis(); //Note time
-      hp.setRemoteTemperature(convertLocalUnitToCelsius(temperature, useFahrenheit));
+    if (!found) {
+      sendJsonReturn(request, "full", false);
+      return;
     }
+
+    SubscriptionChange change;
+    change.slot = -1;
+    change.record.url = url;
+    change.record.fields = fields;
+    change.record.interval_ms = doc["interval"] | 0u;
+    sendJsonReturn(request, subChanges.push(change) ? "ok" : "busy", false);
+    return;
   }
-  else if (strcmp(topic, ha_system_set_topic.c_str()) == 0) { // We receive command for board
-    if (strcmp(message, "reboot") == 0) { // We receive reboot command
-      ESP.restart();
-    }
+
+  if (login_password.length() > 0 && login_password != request->arg("pass")) {
+    sendJsonReturn(request, "Bad password", false);
+    return;
   }
-  else if (strcmp(topic, ha_debug_pckts_set_topic.c_str()) == 0) { //if the incoming message is on the heatpump_debug_set_topic topic...
-    if (strcmp(message, "on") == 0) {
-      _debugModePckts = true;
-      mqtt_client.publish(ha_debug_pckts_topic.c_str(), (char*)("Debug packets mode enabled"));
-    } else if (strcmp(message, "off") == 0) {
-      _debugModePckts = false;
-      mqtt_client.publish(ha_debug_pckts_topic.c_str(), (char *)("Debug packets mode disabled"));
+
+  if (request->method() == HTTP_DELETE) {
+    long id = request->arg("id").toInt();
+    if (!request->hasArg("id") || id < 0 || id >= SUBSCRIPTION_MAX || subs[id].url.isEmpty()) {
+      sendJsonReturn(request, "Bad id", false);
+      return;
     }
+    SubscriptionChange change;
+    change.slot = id;
+    sendJsonReturn(request, subChanges.push(change) ? "ok" : "busy", false);
+    return;
   }
-  else if (strcmp(topic, ha_debug_logs_set_topic.c_str()) == 0) { //if the incoming message is on the heatpump_debug_set_topic topic...
-    if (strcmp(message, "on") == 0) {
-      _debugModeLogs = true;
-      mqtt_client.publish(ha_debug_logs_topic.c_str(), (char*)("Debug logs mode enabled"));
-    } else if (strcmp(message, "off") == 0) {
-      _debugModeLogs = false;
-      mqtt_client.publish(ha_debug_logs_topic.c_str(), (char *)("Debug logs mode disabled"));
+
+  StaticJsonDocument<JSON_OBJECT_SIZE(2) + JSON_ARRAY_SIZE(SUBSCRIPTION_MAX) +
+                     SUBSCRIPTION_MAX * (JSON_OBJECT_SIZE(7) + JSON_ARRAY_SIZE(SUB_FIELD_COUNT))> doc;
+  doc["return"] = "ok";
+  JsonArray list = doc.createNestedArray("subscriptions");
+  for (uint8_t i = 0; i < SUBSCRIPTION_MAX; i++) {
+    if (subs[i].url.isEmpty()) continue;
+    JsonObject sub = list.createNestedObject();
+    sub["id"] = i;
+    sub["url"] = subs[i].url.c_str();
+    JsonArray fields = sub.createNestedArray("fields");
+    for (uint8_t f = 0; f < SUB_FIELD_COUNT; f++) {
+      if (subs[i].fields & (1 << f)) fields.add(subFieldNames[f]);
     }
-  }
-  else if(strcmp(topic, ha_custom_packet.c_str()) == 0) { //send custom packet for advance user
-      String custom = message;
+    sub["interval"] = subs[i].interval_ms;
+    sub["delivered"] = subState[i].delivered;
+    sub["failed"] = subState[i].failed;
+    sub["retry"] = subState[i].retryDelay;
+  }
+  String page;
+  serializeJson(doc, page);
+  request->send(200, F("application/json; charset=utf-8"), page);
+}
 
-      // copy custom packet to char array
-      char buffer[(custom.length() + 1)]; // +1 for the NULL at the end
-      custom.toCharArray(buffer, (custom.length() + 1));
+#ifdef USE_MQTT
+// MQTT sink, topics are <mqtt_topic>/<hostname>/...
+//   state         retained, full state as JSON, changes are batched over MQTT_BATCH_INTERVAL_MS
+//   set           commands, same JSON as /json
+//   availability  retained, "online" or "offline" (last will)
+// The client callbacks run in the network task, commands have their own queue to the CN105 side.
+void mqttSetup() {
+  String base = String(mqtt_topic.c_str()) + "/" + hostname.c_str() + "/";
+  mqttStateTopic = base + "state";
+  mqttSetTopic = base + "set";
+  mqttAvailabilityTopic = base + "availability";
+
+  mqttClient.setServer(mqtt_server.c_str(), mqtt_port);
+  mqttClient.setCredentials(mqtt_user.isEmpty() ? nullptr : mqtt_user.c_str(),
+                            mqtt_pwd.isEmpty() ? nullptr : mqtt_pwd.c_str());
+  mqttClient.setClientId(hostname.c_str());
+  // Keep the subscription and the queued QoS 1 commands while we are away
+  mqttClient.setCleanSession(false);
+  mqttClient.setKeepAlive(30);
+  mqttClient.setWill(mqttAvailabilityTopic.c_str(), 1, true, "offline");
+}
 
-      byte bytes[20]; // max custom packet bytes is 20
-      int byteCount = 0;
-      char *nextByte;
+void mqttInit() {
+  mqttClient.onConnect(mqttOnConnect);
+  mqttClient.onDisconnect(mqttOnDisconnect);
+  mqttClient.onMessage(mqttOnMessage);
+  hpBus.subscribe("mqtt", HP_EVENT_MASK(HP_EVENT_SETTINGS) | HP_EVENT_MASK(HP_EVENT_STATUS) |
+                  HP_EVENT_MASK(HP_EVENT_CONNECTED) | HP_EVENT_MASK(HP_EVENT_DISCONNECTED), mqttEvent);
+  mqttConfigVersion = mqttSettingsVersion;
+  mqttSetup();
+}
 
-      // loop over the byte string, breaking it up by spaces (or at the end of the line - \n)
-      nextByte = strtok(buffer, " ");
-      while (nextByte != NULL && byteCount < 20) {
-        bytes[byteCount] = strtol(nextByte, NULL, 16); // convert from hex string
-        nextByte = strtok(NULL, "   ");
-        byteCount++;
-      }
+void mqttOnConnect(bool sessionPresent) {
+  mqttConnecting = false;
+  mqttClient.subscribe(mqttSetTopic.c_str(), 1);
+  mqttClient.publish(mqttAvailabilityTopic.c_str(), 1, true, "online");
+  // The retained state may be older than this session
+  mqttPublishedVersion = 0xFFFFFFFF;
+  mqttDirty = true;
+}
+
+void mqttOnDisconnect(AsyncMqttClientDisconnectReason reason) {
+  mqttConnecting = false;
+}
 
-      // dump the packet so we can see what it is. handy because you can run the code without connecting the ESP to the heatpump, and test sending custom packets
-      hpPacketDebug(bytes, byteCount, "customPacket");
+void mqttOnMessage(char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
+  // Commands are small, ignore anything split in several chunks
+  if (index != 0 || len != total) return;
 
-      hp.sendCustomPacket(bytes, byteCount);
+  StaticJsonDocument<256> doc;
+  if (deserializeJson(doc, (const char*)payload, len)) return;
+  hpJsonCommands(doc.as<JsonObject>(), mqttCommands);
+}
+
+// Event bus subscriber, only remember something changed
+void mqttEvent(const HpEvent& event) {
+  mqttDirty = true;
+}
+
+void mqttPublishState() {
+  uint32_t version;
+  HpSnapshot snapshot = hpRead(&version);
+  mqttDirty = false;
+  mqttLastPublish = millis();
+  if (version == mqttPublishedVersion) return;
+
+  StaticJsonDocument<JSON_OBJECT_SIZE(10)> doc;
+  doc["connected"]           = snapshot.connected;
+  doc["power"]               = hpPowerNames[snapshot.settings.power].name;
+  doc["mode"]                = hpModeNames[snapshot.settings.mode].name;
+  doc["fan"]                 = hpFanNames[snapshot.settings.fan].name;
+  doc["vane"]                = hpVaneNames[snapshot.settings.vane].name;
+  doc["widevane"]            = hpWideVaneNames[snapshot.settings.wideVane].name;
+  doc["temperature"]         = convertCelsiusToLocalUnit(snapshot.settings.temperature, useFahrenheit);
+  doc["roomTemperature"]     = convertCelsiusToLocalUnit(snapshot.roomTemperature, useFahrenheit);
+  doc["compressorFrequency"] = snapshot.compressorFrequency;
+  doc["action"]              = snapshot.operating;
+
+  char payload[256];
+  serializeJson(doc, payload, sizeof(payload));
+  if (mqttClient.publish(mqttStateTopic.c_str(), 1, true, payload) != 0) {
+    mqttPublishedVersion = version;
   }
   else {
-    mqtt_client.publish(ha_debug_logs_topic.c_str(), strcat((char *)"heatpump: wrong mqtt topic: ", topic));
+    mqttDirty = true;
+  }
+}
+
+void mqttLoop() {
+  if (mqttConfigVersion != mqttSettingsVersion) {
+    // MQTT settings saved, start again with the new broker and topics
+    mqttConfigVersion = mqttSettingsVersion;
+    if (mqttClient.connected() || mqttConnecting) mqttClient.disconnect();
+    mqttConnecting = false;
+    mqttSetup();
+  }
+  if (mqtt_server.isEmpty()) return;
+
+  if (!mqttClient.connected()) {
+    if (!mqttConnecting && WiFi.status() == WL_CONNECTED && millis() - mqttLastAttempt >= MQTT_RETRY_INTERVAL_MS) {
+      mqttLastAttempt = millis();
+      mqttConnecting = true;
+      mqttClient.connect();
+    }
+    return;
+  }
+
+  if (mqttDirty && millis() - mqttLastPublish >= MQTT_BATCH_INTERVAL_MS) {
+    mqttPublishState();
   }
 }
 #endif
 
 
-bool connectWifi() {
+const char* wifiSsid(uint8_t network) {
+  return network == 0 ? ap_ssid.c_str() : wifi_ssid[network - 1].c_str();
+}
+
+const char* wifiPwd(uint8_t network) {
+  return network == 0 ? ap_pwd.c_str() : wifi_pwd[network - 1].c_str();
+}
+
+uint8_t wifiNetworkCount() {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < WIFI_MAX_NETWORKS; i++) {
+    if (wifiSsid(i)[0] != '\0') count++;
+  }
+  return count;
+}
+
+// Slot of the n-th configured network, the slots can have gaps
+uint8_t wifiNthNetwork(uint8_t n) {
+  for (uint8_t i = 0; i < WIFI_MAX_NETWORKS; i++) {
+    if (wifiSsid(i)[0] == '\0') continue;
+    if (n-- == 0) return i;
+  }
+  return 0;
+}
+
+// Best known network in the scan results, according to the signal and the history:
+// every 250ms of usual connection time or every recent failure cost as much as a few dB.
+// Return -1 if none is visible.
+int wifiPickNetwork(int scanCount, uint8_t* bssid, uint8_t& channel, int32_t& rssi) {
+  int best = -1;
+  int32_t bestScore = INT32_MIN;
+
+  for (int i = 0; i < scanCount; i++) {
+    String ssid = WiFi.SSID(i);
+    for (uint8_t n = 0; n < WIFI_MAX_NETWORKS; n++) {
+      if (wifiSsid(n)[0] == '\0' || ssid != wifiSsid(n)) continue;
+
+      int32_t score = WiFi.RSSI(i) - wifi_history[n].connectMs / 250 - 10 * min(wifi_history[n].failures, (uint8_t)5);
+      if (score > bestScore) {
+        bestScore = score;
+        best = n;
+        memcpy(bssid, WiFi.BSSID(i), 6);
+        channel = WiFi.channel(i);
+        rssi = WiFi.RSSI(i);
+      }
+    }
+  }
+
+  return best;
+}
+
+void wifiSetMode() {
 #ifdef ESP32
   WiFi.setHostname(hostname.c_str());
 #else
   WiFi.hostname(hostname.c_str());
 #endif
-  if (WiFi.getMode() != WIFI_STA) {
-    WiFi.mode(WIFI_STA);
-    delay(100);
-  }
+  // Keep the fallback access point while retrying
+  WiFi.mode(wifiFallbackAP ? WIFI_AP_STA : WIFI_STA);
+}
+
+// Start a connection attempt, wifiLoop() follows it
+void wifiBegin() {
+  wifiSetMode();
+
+  // Only the first attempt after a boot or a link loss use the cached connection
+  wifiFastConnect = (wifiRetries == 0 && wifi_channel != 0 && wifi_network < WIFI_MAX_NETWORKS && wifiSsid(wifi_network)[0] != '\0');
+  if (wifiState != WIFI_STATE_CONNECTING && wifiState != WIFI_STATE_SCANNING) wifiAttemptStart = millis();
 
+  // Always DHCP, a lease reused as a static address would outlive the one of the router
 #ifdef ESP32
   WiFi.config((uint32_t)0, (uint32_t)0, (uint32_t)0);
 #else
   WiFi.config(0, 0, 0);
 #endif
 
-  WiFi.begin(ap_ssid.c_str(), ap_pwd.c_str());
-  write_log("Connecting to " + ap_ssid);
-  wifi_timeout = millis() + 30000;
-
-  while (WiFi.status() != WL_CONNECTED && millis() < wifi_timeout) {
-    write_log(".");
-    //write_log(WiFi.status());
-    // wait 500ms, flashing the blue LED to indicate WiFi connecting...
-    digitalWrite(blueLedPin, LOW);
-    delay(250);
-    digitalWrite(blueLedPin, HIGH);
-    delay(250);
+  if (wifiFastConnect)
+  {
+    // Skip the scan, going straight to the known access point
+    wifiConnectTo(wifi_network, wifi_channel, wifi_bssid);
   }
-
-  if (WiFi.status() != WL_CONNECTED) {
-    write_log(F("Failed to connect to wifi"));
-    return false;
+  else
+  {
+    // Look for the best network first
+    WiFi.scanNetworks(true);
+    wifiState = WIFI_STATE_SCANNING;
+    wifiStateSince = millis();
   }
+}
 
-  wifi_timeout = millis() + 5000;
-  while ((WiFi.localIP().toString() == "0.0.0.0" || WiFi.localIP().toString() == "") && millis() < wifi_timeout) {
-    write_log(".");
-    delay(500);
-  }
-  if (WiFi.localIP().toString() == "0.0.0.0" || WiFi.localIP().toString() == "") {
-    write_log(F("Failed to get IP address"));
-    return false;
-  }
+void wifiConnectTo(uint8_t network, uint8_t channel, const uint8_t* bssid) {
+  wifiCurrent = network;
+  WiFi.begin(wifiSsid(network), wifiPwd(network), channel, bssid);
+  write_log(String(F("Connecting to ")) + wifiSsid(network));
 
-  //write_log(F("\nConnected with IP address: "));
-  //write_log(WiFi.localIP().toString());
+  wifiState = WIFI_STATE_CONNECTING;
+  wifiStateSince = millis();
+}
 
-  //ticker.detach(); // Stop blinking the LED because now we are connected:)
+// Save the connection parameters for the next fast reconnect, when they changed.
+// The network history is updated in RAM on each connection and written with them.
+void wifiSaveConnection() {
+  uint8_t* bssid = WiFi.BSSID();
+  uint8_t channel = WiFi.channel();
+
+  ConfigGuard guard;
+  // Smooth the connection time over the last connections
+  WifiHistory& history = wifi_history[wifiCurrent];
+  uint16_t connectMs = min(wifiConnectDuration, 65535UL);
+  history.connectMs = history.connectMs ? (history.connectMs * 3 + connectMs) / 4 : connectMs;
+  history.rssi = WiFi.RSSI();
+  history.failures = 0;
+
+  if (!bssid || (wifiCurrent == wifi_network && memcmp(bssid, wifi_bssid, sizeof(wifi_bssid)) == 0 &&
+                 channel == wifi_channel))
+  {
+    return;
+  }
 
-  //keep LED off (For Wemos D1-Mini)
-  digitalWrite(blueLedPin, HIGH);
+  memcpy(wifi_bssid, bssid, sizeof(wifi_bssid));
+  wifi_network = wifiCurrent;
+  wifi_channel = channel;
+  saveConfig();
+}
 
-  // Auto reconnected
-  WiFi.setAutoReconnect(true);
-  WiFi.persistent(true);
+// Wifi state machine, never blocks and never reboots.
+// The HVAC keep being synced while the connection is down, and after
+// WIFI_CONNECT_TIMEOUT_MS our own access point is opened for local control.
+void wifiLoop() {
+  unsigned long now = millis();
 
-  return true;
-}
+  switch (wifiState)
+  {
+    case WIFI_STATE_SCANNING:
+    {
+      int scanCount = WiFi.scanComplete();
+      if (scanCount == WIFI_SCAN_RUNNING && now - wifiStateSince < WIFI_SCAN_TIMEOUT_MS)
+      {
+        digitalWrite(blueLedPin, (now / 250) % 2 ? HIGH : LOW);
+        break;
+      }
 
-// temperature helper these are direct mappings based on the remote
-float toFahrenheit(float fromCelsius) {
-    // Lookup table for specific mappings
-    const std::map<float, int> lookupTable = {
-        {16.0, 61}, {16.5, 62}, {17.0, 63}, {17.5, 64}, {18.0, 65},
-        {18.5, 66}, {19.0, 67}, {20.0, 68}, {21.0, 69}, {21.5, 70},
-        {22.0, 71}, {22.5, 72}, {23.0, 73}, {23.5, 74}, {24.0, 75},
-        {24.5, 76}, {25.0, 77}, {25.5, 78}, {26.0, 79}, {26.5, 80},
-        {27.0, 81}, {27.5, 82}, {28.0, 83}, {28.5, 84}, {29.0, 85},
-        {29.5, 86}, {30.0, 87}, {30.5, 88}
-    };
+      uint8_t bssid[6];
+      uint8_t channel = 0;
+      int32_t rssi;
+      int network = wifiPickNetwork(scanCount, bssid, channel, rssi);
+      WiFi.scanDelete();
 
-    // Check if the input is in the lookup table
-    auto it = lookupTable.find(fromCelsius);
-    if (it != lookupTable.end()) {
-        return it->second;
+      if (network >= 0)
+      {
+        wifiConnectTo(network, channel, bssid);
+      }
+      else
+      {
+        // Nothing seen, the network can be hidden, try them in turn
+        uint8_t count = wifiNetworkCount();
+        wifiConnectTo(count ? wifiNthNetwork(wifiRetries % count) : 0, 0, nullptr);
+      }
+      break;
     }
 
-    // Default conversion and rounding to nearest integer
-    return roundf(fromCelsius * 1.8 + 32.0);
-}
+    case WIFI_STATE_CONNECTING:
+      if (WiFi.status() == WL_CONNECTED && (uint32_t)WiFi.localIP() != 0)
+      {
+        wifiState = WIFI_STATE_CONNECTED;
+        wifiStateSince = now;
+        wifiRoamCheck = now;
+        wifiRetries = 0;
+        wifiConnectDuration = now - wifiAttemptStart;
+        wifiConnectWasFast = wifiFastConnect;
+        wifiSaveConnection();
+
+        //keep LED off (For Wemos D1-Mini)
+        digitalWrite(blueLedPin, HIGH);
+
+        // Auto reconnected
+        WiFi.setAutoReconnect(true);
+        WiFi.persistent(true);
+
+        if (wifiFallbackAP)
+        {
+          WiFi.softAPdisconnect(true);
+          wifiFallbackAP = false;
+        }
 
-// temperature helper these are direct mappings based on the remote
-float toCelsius(float fromFahrenheit) {
-    // Lookup table for specific mappings
-    const std::map<int, float> lookupTable = {
-        {61, 16.0}, {62, 16.5}, {63, 17.0}, {64, 17.5}, {65, 18.0},
-        {66, 18.5}, {67, 19.0}, {68, 20.0}, {69, 21.0}, {70, 21.5},
-        {71, 22.0}, {72, 22.5}, {73, 23.0}, {74, 23.5}, {75, 24.0},
-        {76, 24.5}, {77, 25.0}, {78, 25.5}, {79, 26.0}, {80, 26.5},
-        {81, 27.0}, {82, 27.5}, {83, 28.0}, {84, 28.5}, {85, 29.0},
-        {86, 29.5}, {87, 30.0}, {88, 30.5}
-    };
+        write_log(String(F("Connected with IP address: ")) + WiFi.localIP().toString());
+        bootMark(BOOT_WIFI);
+        if (!otaStarted)
+        {
+          initOTA();
+          otaStarted = true;
+        }
+      }
+      else if (wifiFastConnect && now - wifiStateSince > WIFI_FAST_CONNECT_TIMEOUT_MS)
+      {
+        // The access point moved or is gone, do a full connection right now
+        write_log(F("Fast connection failed"));
+        WiFi.disconnect();
+        wifi_channel = 0;
+        wifiBegin();
+      }
+      else if (now - wifiStateSince > WIFI_CONNECT_TIMEOUT_MS)
+      {
+        write_log(F("Failed to connect to wifi"));
+        WiFi.disconnect();
+        {
+          ConfigGuard guard;
+          if (wifi_history[wifiCurrent].failures < 255) wifi_history[wifiCurrent].failures++;
+        }
+        wifiRetries++;
+        wifiState = WIFI_STATE_WAIT_RETRY;
+        wifiStateSince = now;
+
+        if (!wifiFallbackAP)
+        {
+          // Set AP password when falling back to AP on fail
+          WiFi.mode(WIFI_AP_STA);
+          startSoftAP(login_password.isEmpty() ? nullptr : login_password.c_str());
+          wifiFallbackAP = true;
+          write_log(F("Fallback access point started"));
+        }
+      }
+      else
+      {
+        // flashing the blue LED every 250ms to indicate WiFi connecting...
+        digitalWrite(blueLedPin, (now / 250) % 2 ? HIGH : LOW);
+      }
+      break;
+
+    case WIFI_STATE_CONNECTED:
+      if (WiFi.status() != WL_CONNECTED)
+      {
+        // Let the auto reconnection work first
+        write_log(F("Wifi connection lost"));
+        wifiState = WIFI_STATE_CONNECTING;
+        wifiStateSince = now;
+        wifiAttemptStart = now;
+        wifiFastConnect = false;
+      }
+      else if (wifi_roaming && now - wifiRoamCheck > WIFI_ROAM_CHECK_MS)
+      {
+        // Weak signal, look for a better access point in background
+        wifiRoamCheck = now;
+        if (WiFi.RSSI() < WIFI_ROAM_RSSI)
+        {
+          WiFi.scanNetworks(true);
+          wifiState = WIFI_STATE_ROAMING;
+          wifiStateSince = now;
+        }
+      }
+      break;
 
-    // Check if the input is in the lookup table
-    auto it = lookupTable.find(static_cast<int>(fromFahrenheit));
-    if (it != lookupTable.end()) {
-        return it->second;
+    case WIFI_STATE_ROAMING:
+    {
+      int scanCount = WiFi.scanComplete();
+      if (scanCount == WIFI_SCAN_RUNNING && now - wifiStateSince < WIFI_SCAN_TIMEOUT_MS)
+      {
+        break;
+      }
+
+      uint8_t bssid[6];
+      uint8_t channel = 0;
+      int32_t rssi;
+      int network = wifiPickNetwork(scanCount, bssid, channel, rssi);
+      WiFi.scanDelete();
+
+      wifiState = WIFI_STATE_CONNECTED;
+      if (WiFi.status() == WL_CONNECTED && network >= 0 && rssi > WiFi.RSSI() + WIFI_ROAM_MARGIN &&
+          memcmp(bssid, WiFi.BSSID(), sizeof(bssid)) != 0)
+      {
+        write_log(F("Roaming to a stronger access point"));
+        wifiAttemptStart = now;
+        wifiFastConnect = false;
+        WiFi.disconnect();
+        wifiConnectTo(network, channel, bssid);
+      }
+      break;
     }
 
-    // Default conversion and rounding to nearest 0.5
-    return roundf((fromFahrenheit - 32.0) / 1.8 * 2) / 2.0;
-}
+    case WIFI_STATE_WAIT_RETRY:
+    {
+      // Try every configured network once, then use exponential backoff between rounds, up to WIFI_RETRY_INTERVAL_MS.
+      // Only the size of a round matters here, the networks are picked with wifiNthNetwork()
+      uint8_t count = max(wifiNetworkCount(), (uint8_t)1);
+      uint32_t backoff = 0;
+      if (wifiRetries % count == 0)
+      {
+        backoff = WIFI_RETRY_MIN_MS << min(wifiRetries / count, 6u);
+        if (backoff > WIFI_RETRY_INTERVAL_MS) backoff = WIFI_RETRY_INTERVAL_MS;
+      }
+      if (now - wifiStateSince >= backoff)
+      {
+        wifiBegin();
+      }
+      break;
+    }
 
+    default:
+      break;
+  }
+}
 
 float convertCelsiusToLocalUnit(float temperature, bool isFahrenheit) {
   if (isFahrenheit) {
@@ -1736,10 +3051,10 @@ String getId() {
 }
 
 //Check if header is present and correct
-bool is_authenticated() {
-  if (server.hasHeader("Cookie")) {
+bool is_authenticated(AsyncWebServerRequest* request) {
+  if (request->hasHeader("Cookie")) {
     //Found cookie;
-    String cookie = server.header("Cookie");
+    String cookie = request->getHeader("Cookie")->value();
     if (cookie.indexOf("M2MSESSIONID=1") != -1) {
       //Authentication Successful
       return true;
@@ -1749,19 +3064,10 @@ bool is_authenticated() {
   return false;
 }
 
-bool checkLogin() {
-  if (!is_authenticated() and login_password.length() > 0) {
-    server.sendHeader("Location", "/login");
-    server.sendHeader("Cache-Control", "no-cache");
+bool checkLogin(AsyncWebServerRequest* request) {
+  if (!is_authenticated(request) and login_password.length() > 0) {
     //use javascript in the case browser disable redirect
-    String redirectPage = F("<html lang=\"en\" class=\"\"><head><meta charset='utf-8'>");
-    redirectPage += F("<script>");
-    redirectPage += F("setTimeout(function () {");
-    redirectPage += F("window.location.href= '/login';");
-    redirectPage += F("}, 1000);");
-    redirectPage += F("</script>");
-    redirectPage += F("</body></html>");
-    server.send(302, F("text/html"), redirectPage);
+    sendRedirect(request, "/login", true);
     return false;
   }
   return true;
@@ -1772,9 +3078,30 @@ bool checkLogin() {
 //Main loop
 void loop()
 {
-  server.handleClient();
   ArduinoOTA.handle();
 
+  if (rebootAt && (long)(millis() - rebootAt) >= 0)
+  {
+    if (rebootFormat) SPIFFS.format();
+    ESP.restart();
+  }
+
+  if (wifiRestartAt && (long)(millis() - wifiRestartAt) >= 0)
+  {
+    wifiRestartAt = 0;
+    wifiRestart();
+  }
+
+  if (otaRestart) {
+    // New hostname or password: ArduinoOTA.begin() also announces the hostname with mDNS again
+    otaRestart = false;
+    if (otaStarted) {
+      ArduinoOTA.end();
+      initOTA();
+    }
+  }
+  heapTick();
+
 #if 0
   //debug part
   if (millis() - lastdebugtimer > 5000)
@@ -1787,37 +3114,22 @@ void loop()
   }
 #endif
 
-  //reset board to attempt to connect to wifi again if in ap mode or wifi dropped out and time limit passed
-  if (WiFi.getMode() == WIFI_STA and WiFi.status() == WL_CONNECTED)
-  {
-	  wifi_timeout = millis() + WIFI_RETRY_INTERVAL_MS;
-  }
-  else if (wifi_config_exists and millis() > wifi_timeout)
-  {
-	  ESP.restart();
-  }
-
   if (!captive)
   {
-    // Sync HVAC UNIT
-    if (!hp.isConnected())
-    {
-      // Use exponential backoff for retries, where each retry is double the length of the previous one.
-      unsigned long durationNextSync = (1 << hpConnectionRetries) * HP_RETRY_INTERVAL_MS;
-      if (((millis() - lastHpSync > durationNextSync) or lastHpSync == 0))
-      {
-        lastHpSync = millis();
-        // If we've retried more than the max number of tries, keep retrying at that fixed interval, which is several minutes.
-        hpConnectionRetries = min(hpConnectionRetries + 1u, HP_MAX_RETRIES);
-        hpConnectionTotalRetries++;
-        hp.sync();
-      }
-    }
-    else
-    {
-        hpConnectionRetries = 0;
-        hp.sync();
-    }
+    wifiLoop();
+
+    // Sync HVAC UNIT, in its own task when there is a second core
+#ifndef HP_TASK
+    hpService();
+#endif
+    hpBus.dispatch(HP_EVENTS_PER_LOOP);
+#ifdef USE_MQTT
+    mqttLoop();
+#endif
+    mcastLoop();
+    subLoop();
+    remoteTempUdpLoop();
+    hpCheckRemoteTemp();
 
   }
   else
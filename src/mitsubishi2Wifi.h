@@ -1,5 +1,10 @@
 #include <Arduino.h>
 #include <HeatPump.h>
+#include "hpstate.h"
+#include "configstore.h"
+#include <ESPAsyncWebServer.h>
+
+typedef void (*HttpHandler)(AsyncWebServerRequest* request);
 
 String getId();
 float convertCelsiusToLocalUnit(float temperature, bool isFahrenheit);
@@ -8,45 +13,115 @@ String getTemperatureScale();
 void write_log(String log);
 
 void setWIFIDefaults();
-bool checkLogin();
-bool is_authenticated();
+bool checkLogin(AsyncWebServerRequest* request);
+bool is_authenticated(AsyncWebServerRequest* request);
 void initOTA();
 
+bool loadConfig();
+bool saveConfig();
+void migrateConfig();
 bool loadOthers();
 bool loadUnit();
 bool loadWifi();
-void saveWifi(String apSsid, String apPwd, String hostName, String otaPwd);
+void saveWifi(const String& apSsid, const String& apPwd, const String& hostName, const String& otaPwd);
 
-bool connectWifi();
 bool initWifi();
-void handleSaveWifi();
-
-// Web pages
-void handleRoot();
-void handleSetup();
-void handleServer();
-void handleWifi();
-void handleUnit();
-void handleStatus();
-void handleOthers();
-void handleMetrics();
-void handleJson();
-void handleLogs();
-
-void handleReboot();
+void startSoftAP(const char* password);
+const char* wifiSsid(uint8_t network);
+const char* wifiPwd(uint8_t network);
+uint8_t wifiNetworkCount();
+uint8_t wifiNthNetwork(uint8_t n);
+int wifiPickNetwork(int scanCount, uint8_t* bssid, uint8_t& channel, int32_t& rssi);
+void wifiSetMode();
+void wifiBegin();
+void wifiConnectTo(uint8_t network, uint8_t channel, const uint8_t* bssid);
+void wifiSaveConnection();
+void wifiLoop();
+void handleSaveWifi(AsyncWebServerRequest* request);
+
+// Web pages, called from the network task
+String wrapHTML(const String& content);
+void sendWrappedHTML(AsyncWebServerRequest* request, String content, const char* cookie = nullptr);
+void sendRedirect(AsyncWebServerRequest* request, const char* location, bool script = false);
+void scheduleReboot(bool format);
+void handleRoot(AsyncWebServerRequest* request);
+void handleSetup(AsyncWebServerRequest* request);
+void handleServer(AsyncWebServerRequest* request);
+void handleWifi(AsyncWebServerRequest* request);
+void handleUnit(AsyncWebServerRequest* request);
+void handleStatus(AsyncWebServerRequest* request);
+void handleOthers(AsyncWebServerRequest* request);
+void handleMetrics(AsyncWebServerRequest* request);
+String metricsLive();
+void handleDebugHeap(AsyncWebServerRequest* request);
+void handleConfigExport(AsyncWebServerRequest* request);
+void handleJson(AsyncWebServerRequest* request);
+void handleJsonBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total);
+bool requestBody(AsyncWebServerRequest* request, const char*& body, size_t& length);
+bool requestTooLarge(AsyncWebServerRequest* request);
+void sendJsonReturn(AsyncWebServerRequest* request, const char* result, bool msgpack, int code = 200, uint32_t retryAfter = 0);
+void sendTooManyRequests(AsyncWebServerRequest* request, uint32_t retryAfter);
+uint32_t clientIp(AsyncWebServerRequest* request);
+void handleLogs(AsyncWebServerRequest* request);
+
+void handleReboot(AsyncWebServerRequest* request);
+void sendSavedPage(AsyncWebServerRequest* request);
+// What a saved page changed besides the settings themselves
+enum ConfigChange : uint8_t {
+  CONFIG_WIFI = 1,   // networks or hostname, the connection starts again
+  CONFIG_OTA  = 2,   // hostname or OTA password, the listener and mDNS start again
+  CONFIG_MQTT = 4    // broker or topic, the MQTT session starts again
+};
+void applyConfig(uint8_t changes);
+void wifiRestart();
 bool loadServerSettings();
-void handleLogin();
-void handleUpgrade();
-void handleUploadDone();
+void handleLogin(AsyncWebServerRequest* request);
+void handleUpgrade(AsyncWebServerRequest* request);
+void handleUploadDone(AsyncWebServerRequest* request);
 
 
-void handleNotFound();
-void handleUploadLoop();
-void handleControl();
+void handleNotFound(AsyncWebServerRequest* request);
+void handleUploadLoop(AsyncWebServerRequest* request, const String& filename, size_t index, uint8_t* data, size_t len, bool final);
+void handleControl(AsyncWebServerRequest* request);
+void selectOption(String& page, const char* placeholder);
 
-void handleInitSetup() ;
+void handleInitSetup(AsyncWebServerRequest* request);
 
 void hpStatusChanged(heatpumpStatus currentStatus);
 void hpCheckRemoteTemp();
+void hpPoll();
+void hpService();
+void hpPublish();
+HpSnapshot hpRead(uint32_t* version = nullptr);
+void hpTask(void* parameter);
+void hpPushEvent(const HpEvent& event);
+
+#ifdef USE_MQTT
+#include <AsyncMqttClient.h>
+void mqttInit();
+void mqttSetup();
+void mqttLoop();
+void mqttOnConnect(bool sessionPresent);
+void mqttOnDisconnect(AsyncMqttClientDisconnectReason reason);
+void mqttOnMessage(char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total);
+void mqttEvent(const HpEvent& event);
+void mqttPublishState();
+#endif
+void hpPublishEvent(HpEventType type);
+bool hpCommand(HpCommandType type, uint8_t value = 0, float temperature = 0);
+bool hpQueueCommand(HpCommandQueue& queue, HpCommandType type, uint8_t value = 0, float temperature = 0);
+void hpExecute(const HpCommand& command);
+void remoteTempReading(float temperature);
+void remoteTempUdpLoop();
+void mcastEvent(const HpEvent& event);
+void mcastLoop();
+void subEvent(const HpEvent& event);
+void subLoop();
+void subDeliver(uint8_t index);
+void subFinish(uint8_t index);
+bool subParseUrl(const char* url, String& host, uint16_t& port, String& hostHeader, String& path);
+void subReset(uint8_t index);
+void subCopy(SubscriptionRecord* out);
+void handleSubscriptions(AsyncWebServerRequest* request);
 void hpSettingsChanged();
 void hpPacketDebug(byte* packet, unsigned int length, const char* packetDirection);
\ No newline at end of file
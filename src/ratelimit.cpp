@@ -0,0 +1,78 @@
+#include "ratelimit.h"
+
+struct RateLimit {
+  uint16_t clientBurst;
+  uint16_t clientPerMinute;
+  uint16_t endpointBurst;       // all clients together
+  uint16_t endpointPerMinute;
+};
+
+// An automation polling /json every second is fine, a loop without delay is not
+static const RateLimit rateLimits[RATE_ENDPOINTS] = {
+  { 10, 120, 20, 300 },   // RATE_JSON
+  {  5,  10, 10,  30 },   // RATE_SUBSCRIPTIONS, each change is a flash write
+  { 10,  60, 20, 120 },   // RATE_CONTROL, only with a command
+};
+
+uint32_t TokenBucket::take(uint16_t burst, uint16_t perMinute, uint8_t count, uint32_t now) {
+  uint32_t full = burst * 1000UL;
+  if (!started) {
+    started = true;
+    tokens = full;
+  }
+  else {
+    // perMinute / 60 thousandths of a token per ms, a long idle time just fills the bucket
+    uint32_t elapsed = now - last;
+    if (elapsed >= 60000UL * burst) tokens = full;
+    else tokens = min(full, tokens + elapsed * perMinute / 60);
+  }
+  last = now;
+
+  uint32_t needed = count * 1000UL;
+  if (tokens >= needed) {
+    tokens -= needed;
+    return 0;
+  }
+  return ((needed - tokens) * 60 + perMinute - 1) / perMinute;
+}
+
+uint32_t RateLimiter::admit(uint32_t ip, RateEndpoint endpoint) {
+  uint32_t now = millis();
+  const RateLimit& limit = rateLimits[endpoint];
+
+  Client* client = findClient(ip, now);
+  uint32_t wait = client->buckets[endpoint].take(limit.clientBurst, limit.clientPerMinute, 1, now);
+  if (wait) return reject(wait);
+  wait = endpoints[endpoint].take(limit.endpointBurst, limit.endpointPerMinute, 1, now);
+  if (wait) return reject(wait);
+  return 0;
+}
+
+uint32_t RateLimiter::admitWrites(uint8_t count) {
+  if (count == 0) return 0;
+  uint32_t wait = writes.take(RATE_WRITES_BURST, RATE_WRITES_PER_MINUTE, count, millis());
+  return wait ? reject(wait) : 0;
+}
+
+// The client, or the slot of the least recently seen one, which starts again with full buckets
+RateLimiter::Client* RateLimiter::findClient(uint32_t ip, uint32_t now) {
+  Client* oldest = &clients[0];
+  for (uint8_t i = 0; i < clientCount; i++) {
+    if (clients[i].ip == ip) {
+      clients[i].lastSeen = now;
+      return &clients[i];
+    }
+    if (now - clients[i].lastSeen > now - oldest->lastSeen) oldest = &clients[i];
+  }
+
+  Client* client = clientCount < RATE_MAX_CLIENTS ? &clients[clientCount++] : oldest;
+  *client = Client();
+  client->ip = ip;
+  client->lastSeen = now;
+  return client;
+}
+
+uint32_t RateLimiter::reject(uint32_t waitMs) {
+  rejected++;
+  return (waitMs + 999) / 1000;
+}
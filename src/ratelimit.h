@@ -0,0 +1,51 @@
+#pragma once
+#include <Arduino.h>
+
+// Clients remembered by the limiter, the least recently seen one is replaced
+#define RATE_MAX_CLIENTS 8
+// Commands sent to the unit by the web clients, whoever sends them
+#define RATE_WRITES_BURST 8
+#define RATE_WRITES_PER_MINUTE 30
+
+// Routes with a limit, each one has its own budget
+enum RateEndpoint : uint8_t {
+  RATE_JSON,
+  RATE_SUBSCRIPTIONS,
+  RATE_CONTROL,
+  RATE_ENDPOINTS
+};
+
+// Up to burst tokens, refilled at perMinute. Counted in thousandths of a token.
+struct TokenBucket {
+  uint32_t tokens = 0;
+  uint32_t last = 0;
+  bool started = false;
+
+  // 0 if count tokens were taken, otherwise the milliseconds before they are available
+  uint32_t take(uint16_t burst, uint16_t perMinute, uint8_t count, uint32_t now);
+};
+
+// Admission of the requests which cost something (parsing, flash writes, CN105 commands).
+// Only used from the network task, so there is no lock. A check is a few compares on a small table.
+class RateLimiter {
+  public:
+    // 0 when admitted, otherwise the seconds to send in Retry-After
+    uint32_t admit(uint32_t ip, RateEndpoint endpoint);
+    uint32_t admitWrites(uint8_t count);
+
+    uint32_t rejected = 0;
+
+  private:
+    struct Client {
+      uint32_t ip = 0;
+      uint32_t lastSeen = 0;
+      TokenBucket buckets[RATE_ENDPOINTS];
+    };
+    Client* findClient(uint32_t ip, uint32_t now);
+    uint32_t reject(uint32_t waitMs);
+
+    Client clients[RATE_MAX_CLIENTS];
+    uint8_t clientCount = 0;
+    TokenBucket endpoints[RATE_ENDPOINTS];
+    TokenBucket writes;
+};
@@ -0,0 +1,104 @@
+#include "responsecache.h"
+
+bool ResponseCache::serve(AsyncWebServerRequest* request, CacheRoute route, uint32_t stateVersion, uint32_t configVersion,
+                          CacheSuffix suffix) {
+  Entry& entry = entries[route];
+  if (entry.buffer < 0 || entry.stateVersion != stateVersion || entry.configVersion != configVersion ||
+      millis() - entry.renderedAt > RESPONSE_CACHE_MAX_AGE_MS) {
+    misses++;
+    return false;
+  }
+  hits++;
+
+  // The bytes are read in place, the buffer is kept until the connection is gone.
+  // The suffix is rendered after the hit is counted.
+  Buffer* buffer = &buffers[entry.buffer];
+  buffer->users++;
+  request->onDisconnect([buffer]() { buffer->users--; });
+  String live = suffix ? suffix() : String();
+  AsyncWebServerResponse* response = request->beginResponse(entry.contentType, buffer->length + live.length(),
+    [buffer, live](uint8_t* out, size_t maxLen, size_t index) -> size_t {
+      size_t n = 0;
+      if (index < buffer->length) {
+        n = min(buffer->length - index, maxLen);
+        memcpy(out, buffer->data + index, n);
+      }
+      else {
+        n = min(live.length() - (index - buffer->length), maxLen);
+        memcpy(out, live.c_str() + (index - buffer->length), n);
+      }
+      return n;
+    });
+  request->send(response);
+  return true;
+}
+
+void ResponseCache::send(AsyncWebServerRequest* request, CacheRoute route, uint32_t stateVersion, uint32_t configVersion,
+                         const char* contentType, const String& body, CacheSuffix suffix) {
+  Entry& entry = entries[route];
+  if (store(route, body)) {
+    entry.stateVersion = stateVersion;
+    entry.configVersion = configVersion;
+    entry.renderedAt = millis();
+    entry.contentType = contentType;
+  }
+  if (suffix) request->send(200, contentType, body + suffix());
+  else request->send(200, contentType, body);
+}
+
+bool ResponseCache::store(CacheRoute route, const String& body) {
+  Entry& entry = entries[route];
+  int8_t index = pickBuffer(route, body.length());
+  if (index < 0) {
+    // Too big for the pool, or every buffer is being sent: the old copy is stale anyway
+    entry.buffer = -1;
+    return false;
+  }
+
+  Buffer& buffer = buffers[index];
+  if (buffer.capacity < body.length()) {
+    size_t capacity = roundUp(body.length());
+    char* data = (char*)realloc(buffer.data, capacity);
+    if (!data) {
+      entry.buffer = -1;
+      return false;
+    }
+    allocated += capacity - buffer.capacity;
+    buffer.data = data;
+    buffer.capacity = capacity;
+  }
+  memcpy(buffer.data, body.c_str(), body.length());
+  buffer.length = body.length();
+  entry.buffer = index;
+  return true;
+}
+
+// Buffer for a new rendering of route: its own one if nobody is sending it,
+// then a free one already big enough, then a free one which can grow within the pool
+int8_t ResponseCache::pickBuffer(CacheRoute route, size_t length) {
+  int8_t current = entries[route].buffer;
+  if (current >= 0 && buffers[current].users == 0 && canHold(current, length)) return current;
+
+  bool owned[RESPONSE_CACHE_BUFFERS] = {false};
+  for (uint8_t r = 0; r < CACHE_ROUTES; r++) {
+    if (entries[r].buffer >= 0) owned[entries[r].buffer] = true;
+  }
+
+  int8_t growable = -1;
+  for (int8_t i = 0; i < RESPONSE_CACHE_BUFFERS; i++) {
+    if (owned[i] || buffers[i].users > 0) continue;
+    if (buffers[i].capacity >= length) return i;
+    if (growable < 0 && canHold(i, length)) growable = i;
+  }
+  return growable;
+}
+
+bool ResponseCache::canHold(int8_t index, size_t length) {
+  const Buffer& buffer = buffers[index];
+  if (buffer.capacity >= length) return true;
+  return allocated - buffer.capacity + roundUp(length) <= RESPONSE_CACHE_POOL_BYTES;
+}
+
+size_t ResponseCache::roundUp(size_t length) {
+  return (length + RESPONSE_CACHE_ROUND - 1) / RESPONSE_CACHE_ROUND * RESPONSE_CACHE_ROUND;
+}
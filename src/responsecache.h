@@ -0,0 +1,63 @@
+#pragma once
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+
+// Rendered pages are kept this long at most, they also show values without a version (uptime, heap...)
+#define RESPONSE_CACHE_MAX_AGE_MS 1000
+// Buffers shared by the routes, one more than the routes so a page being sent doesn't block the next render
+#define RESPONSE_CACHE_BUFFERS 4
+#ifdef ESP32
+#define RESPONSE_CACHE_POOL_BYTES 32768
+#else
+#define RESPONSE_CACHE_POOL_BYTES 12288
+#endif
+#define RESPONSE_CACHE_ROUND 512   // buffers grow by this step, to avoid a realloc for each render
+
+enum CacheRoute : uint8_t {
+  CACHE_METRICS,
+  CACHE_STATUS,
+  CACHE_CONTROL,
+  CACHE_ROUTES
+};
+
+// Lines rendered for each request and sent after the cached body, for values which must be current
+typedef String (*CacheSuffix)();
+
+// Last rendering of the read only pages, reused while the state and the settings keep the same versions.
+// Only used from the network task, so there is no lock. A buffer being sent is never overwritten,
+// the next rendering takes another one or is simply not cached.
+class ResponseCache {
+  public:
+    // Send the cached page if it is still valid, otherwise the caller renders it and calls send()
+    bool serve(AsyncWebServerRequest* request, CacheRoute route, uint32_t stateVersion, uint32_t configVersion,
+               CacheSuffix suffix = nullptr);
+    void send(AsyncWebServerRequest* request, CacheRoute route, uint32_t stateVersion, uint32_t configVersion,
+              const char* contentType, const String& body, CacheSuffix suffix = nullptr);
+
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+    size_t poolBytes() const { return allocated; }
+
+  private:
+    struct Buffer {
+      char* data = nullptr;
+      size_t capacity = 0;
+      size_t length = 0;
+      uint8_t users = 0;       // responses still sending it
+    };
+    struct Entry {
+      int8_t buffer = -1;
+      uint32_t stateVersion = 0;
+      uint32_t configVersion = 0;
+      unsigned long renderedAt = 0;
+      const char* contentType = nullptr;
+    };
+    bool store(CacheRoute route, const String& body);
+    int8_t pickBuffer(CacheRoute route, size_t length);
+    bool canHold(int8_t index, size_t length);
+    static size_t roundUp(size_t length);
+
+    Buffer buffers[RESPONSE_CACHE_BUFFERS];
+    Entry entries[CACHE_ROUTES];
+    size_t allocated = 0;
+};
@@ -0,0 +1,38 @@
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+
+// Value published by a single writer and read by anyone without taking a lock.
+// Double buffered: the writer fills the slot readers are not told about, then publishes it,
+// so a reader never waits for a write in progress, even when it preempted the writer.
+// A reader only copies again when a whole new value was published during its copy.
+// The version is incremented by each write, readers can use it to skip work.
+template <typename T>
+class SeqLock {
+  public:
+    // Writer side
+    void write(const T& value) {
+      uint32_t s = seq.load(std::memory_order_relaxed);
+      // the previous publication is visible before the other slot is overwritten
+      std::atomic_thread_fence(std::memory_order_release);
+      slots[(s + 1) & 1] = value;
+      seq.store(s + 1, std::memory_order_release);
+    }
+
+    // Reader side, returns the version of the copy
+    uint32_t read(T& value) const {
+      for (;;) {
+        uint32_t s = seq.load(std::memory_order_acquire);
+        value = slots[s & 1];
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // unchanged, the writer has not started on this slot
+        if (seq.load(std::memory_order_relaxed) == s) return s;
+      }
+    }
+
+    uint32_t version() const { return seq.load(std::memory_order_acquire); }
+
+  private:
+    T slots[2] = {};
+    std::atomic<uint32_t> seq{0};
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+
+// Bounded queue between one producer and one consumer, which may run on different cores.
+// Never blocks nor allocates, a push on a full queue fails and is counted in dropped().
+// N must be a power of two.
+template <typename T, size_t N>
+class SpscQueue {
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+
+  public:
+    // Producer side
+    bool push(const T& item) {
+      uint32_t h = head.load(std::memory_order_relaxed);
+      if (h - tail.load(std::memory_order_acquire) == N) {
+        // Only the producer writes the counter, no read-modify-write needed
+        drops.store(drops.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return false;
+      }
+      items[h & (N - 1)] = item;
+      head.store(h + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Consumer side
+    bool pop(T& item) {
+      uint32_t t = tail.load(std::memory_order_relaxed);
+      if (head.load(std::memory_order_acquire) == t) return false;
+      item = items[t & (N - 1)];
+      tail.store(t + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Approximate when called from a third party
+    size_t size() const {
+      return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+    uint32_t dropped() const { return drops.load(std::memory_order_relaxed); }
+    static constexpr size_t capacity() { return N; }
+
+  private:
+    T items[N];
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    std::atomic<uint32_t> drops{0};
+};
@@ -0,0 +1,56 @@
+#include "temperature.h"
+#include <math.h>
+
+// These are direct mappings based on the remote
+// Celsius side is indexed by half degree, from 16.0 (32) to 30.5 (61)
+const uint8_t REMOTE_MIN_HALF_CELSIUS = 32;
+const uint8_t REMOTE_MIN_FAHRENHEIT = 61;
+
+constexpr uint8_t remoteFahrenheit[] = {
+    61, 62, 63, 64, 65, 66, 67, 67, 68, 69,     // 16.0 .. 20.5
+    69, 70, 71, 72, 73, 74, 75, 76, 77, 78,     // 21.0 .. 25.5
+    79, 80, 81, 82, 83, 84, 85, 86, 87, 88      // 26.0 .. 30.5
+};
+
+// Half degrees Celsius, from 61F to 88F
+constexpr uint8_t remoteHalfCelsius[] = {
+    32, 33, 34, 35, 36, 37, 38, 40, 42, 43,     // 61 .. 70
+    44, 45, 46, 47, 48, 49, 50, 51, 52, 53,     // 71 .. 80
+    54, 55, 56, 57, 58, 59, 60, 61              // 81 .. 88
+};
+
+// Both tables must give back the same remote value
+constexpr bool remoteTablesMatch(unsigned int i) {
+    return i >= sizeof(remoteHalfCelsius) ||
+           (remoteHalfCelsius[i] >= REMOTE_MIN_HALF_CELSIUS &&
+            remoteFahrenheit[remoteHalfCelsius[i] - REMOTE_MIN_HALF_CELSIUS] == REMOTE_MIN_FAHRENHEIT + i &&
+            remoteTablesMatch(i + 1));
+}
+static_assert(remoteTablesMatch(0), "Celsius and Fahrenheit remote tables don't match");
+
+float toFahrenheit(float fromCelsius) {
+    // Direct lookup for the half degrees known by the remote
+    float halfDegrees = fromCelsius * 2;
+    if (halfDegrees >= REMOTE_MIN_HALF_CELSIUS && halfDegrees < REMOTE_MIN_HALF_CELSIUS + sizeof(remoteFahrenheit) &&
+        halfDegrees == static_cast<int>(halfDegrees)) {
+        return remoteFahrenheit[static_cast<int>(halfDegrees) - REMOTE_MIN_HALF_CELSIUS];
+    }
+
+    // Default conversion and rounding to nearest integer
+    return roundf(fromCelsius * 1.8 + 32.0);
+}
+
+float toCelsius(float fromFahrenheit) {
+    // Direct lookup for the values known by the remote
+    int fahrenheit = static_cast<int>(fromFahrenheit);
+    if (fahrenheit >= REMOTE_MIN_FAHRENHEIT && fahrenheit < REMOTE_MIN_FAHRENHEIT + (int)sizeof(remoteHalfCelsius)) {
+        return remoteHalfCelsius[fahrenheit - REMOTE_MIN_FAHRENHEIT] / 2.0f;
+    }
+
+    // Default conversion and rounding to nearest 0.5
+    return roundf((fromFahrenheit - 32.0) / 1.8 * 2) / 2.0;
+}
+
+float fahrenheitToCelsius(float fromFahrenheit) {
+    return (fromFahrenheit - 32.0f) * 5.0f / 9.0f;
+}
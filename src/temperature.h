@@ -0,0 +1,8 @@
+#pragma once
+#include <stdint.h>
+
+// Setpoints, with the values shown by the remote control which aren't the plain conversion
+float toFahrenheit(float fromCelsius);
+float toCelsius(float fromFahrenheit);
+// Plain conversion, without the remote rounding, for measured temperatures
+float fahrenheitToCelsius(float fromFahrenheit);
@@ -3,6 +3,11 @@
 unsigned long times_rolled = 0;
 unsigned long last_time_value = 0;
 
+const char* const bootPhaseNames[BOOT_PHASES] = {
+  "File system", "Config loaded", "Wifi ready", "Web server", "HVAC connect", "First HVAC sync", "First page served"
+};
+uint32_t bootTimeline[BOOT_PHASES];
+
 // Time device running without crash or reboot
 String getUpTime()
 {
@@ -30,4 +35,80 @@ String getUpTime()
   sprintf(uptimeBuffer, "%03i:%02i:%02i:%02i", days, hours, minutes, seconds);
 
   return String(uptimeBuffer);
-}
\ No newline at end of file
+}
+
+// Standard crc32 (IEEE 802.3), bitwise to keep it out of the flash tables
+uint32_t getCrc32(const uint8_t* data, size_t length)
+{
+  uint32_t crc = 0xFFFFFFFF;
+
+  while (length--)
+  {
+    crc ^= *data++;
+    for (uint8_t i = 0; i < 8; i++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+
+  return ~crc;
+}
+
+// Lower case, each byte followed by a space
+void packetToHex(const uint8_t* packet, size_t length, char* out)
+{
+  static const char digits[] = "0123456789abcdef";
+
+  while (length--)
+  {
+    *out++ = digits[*packet >> 4];
+    *out++ = digits[*packet++ & 0x0F];
+    *out++ = ' ';
+  }
+  *out = '\0';
+}
+
+// Remember when a boot phase is reached, only the first time
+void bootMark(BootPhase phase)
+{
+  if (bootTimeline[phase] == 0)
+  {
+    uint32_t now = millis();
+    bootTimeline[phase] = now ? now : 1;
+  }
+}
+
+String getBootTimeline()
+{
+  String timeline;
+
+  for (uint8_t i = 0; i < BOOT_PHASES; i++)
+  {
+    timeline += "<br/>";
+    timeline += bootPhaseNames[i];
+    timeline += " : ";
+    if (bootTimeline[i]) {
+      timeline += String(bootTimeline[i]);
+      timeline += " ms";
+    }
+    else {
+      timeline += "-";
+    }
+  }
+
+  return timeline;
+}
+
+// Poll ready() until it returns true, keeping the background tasks alive
+bool waitFor(bool (*ready)(), uint32_t timeout)
+{
+  uint32_t start = millis();
+
+  while (!ready())
+  {
+    if (millis() - start > timeout) return false;
+    delay(1);
+  }
+
+  return true;
+}
@@ -1,4 +1,23 @@
 #include <Arduino.h>
 
 String getCurrentTime();
-String getUpTime();
\ No newline at end of file
+String getUpTime();
+
+// Boot phases, in the order they are reached
+enum BootPhase : uint8_t {
+  BOOT_FS,
+  BOOT_CONFIG,
+  BOOT_WIFI,
+  BOOT_SERVER,
+  BOOT_HP_CONNECT,
+  BOOT_HP_SYNC,
+  BOOT_FIRST_PAGE,
+  BOOT_PHASES
+};
+
+void bootMark(BootPhase phase);
+String getBootTimeline();
+bool waitFor(bool (*ready)(), uint32_t timeout);
+uint32_t getCrc32(const uint8_t* data, size_t length);
+// "fc 62 01 " for the packet logs, out must hold 3 * length + 1 chars
+void packetToHex(const uint8_t* packet, size_t length, char* out);
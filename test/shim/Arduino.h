@@ -0,0 +1,37 @@
+#pragma once
+// Just enough of the Arduino core to build the pure helpers on the host ([env:native])
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+
+using std::min;
+using std::max;
+
+// Time is moved by the tests, delay() too
+inline uint32_t hostMillis = 0;
+inline uint32_t millis() { return hostMillis; }
+inline void delay(uint32_t ms) { hostMillis += ms; }
+
+class String {
+  public:
+    String() {}
+    String(const char* s) : value(s ? s : "") {}
+    String(const std::string& s) : value(s) {}
+    explicit String(uint32_t n) : value(std::to_string(n)) {}
+
+    String& operator+=(const char* s) { value += s; return *this; }
+    String& operator+=(const String& s) { value += s.value; return *this; }
+    bool operator==(const char* s) const { return value == s; }
+    bool operator==(const String& s) const { return value == s.value; }
+    bool operator!=(const String& s) const { return value != s.value; }
+
+    const char* c_str() const { return value.c_str(); }
+    size_t length() const { return value.length(); }
+
+  private:
+    std::string value;
+};
@@ -0,0 +1,146 @@
+#include <unity.h>
+#include <chrono>
+#include <map>
+#include <new>
+#include <stdlib.h>
+#include <string>
+#include "util.h"
+#include "temperature.h"
+
+// Timings and allocations of the helpers called on each request or event, run with pio test -e native.
+// The allocation counts are checked, the timings depend on the host and are only printed.
+// The std::map conversions and the String hex dump are the versions before the tables and packetToHex().
+// On an x86-64 host with -O2, when added:
+//   toFahrenheit 6 ns, 0 allocs        std::map 830 ns, 28 allocs
+//   toCelsius    3 ns, 0 allocs        std::map 775 ns, 28 allocs
+//   getUpTime    200 ns, 0 allocs (the host String keeps 12 chars inline)
+//   packetToHex  27 ns, 0 allocs       String concatenation 1950 ns, 3 allocs
+
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+  allocations++;
+  void* p = malloc(size);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+struct Measure {
+  double nsPerCall;
+  size_t allocs;        // in the last run
+};
+
+static volatile float floatSink;
+static volatile size_t sizeSink;
+
+// Best of 5 runs, the slower ones were disturbed by the host
+template <typename F>
+static Measure measure(const char* name, uint32_t calls, F call) {
+  Measure result = { 1e30, 0 };
+  for (int run = 0; run < 5; run++) {
+    size_t before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < calls; i++) call(i);
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    if (elapsed.count() / calls < result.nsPerCall) result.nsPerCall = elapsed.count() / calls;
+    result.allocs = allocations - before;
+  }
+  char line[128];
+  snprintf(line, sizeof(line), "%-24s %10.1f ns %8.2f allocs", name, result.nsPerCall, (double)result.allocs / calls);
+  TEST_MESSAGE(line);
+  return result;
+}
+
+static float baselineToFahrenheit(float fromCelsius) {
+    const std::map<float, int> lookupTable = {
+        {16.0, 61}, {16.5, 62}, {17.0, 63}, {17.5, 64}, {18.0, 65},
+        {18.5, 66}, {19.0, 67}, {20.0, 68}, {21.0, 69}, {21.5, 70},
+        {22.0, 71}, {22.5, 72}, {23.0, 73}, {23.5, 74}, {24.0, 75},
+        {24.5, 76}, {25.0, 77}, {25.5, 78}, {26.0, 79}, {26.5, 80},
+        {27.0, 81}, {27.5, 82}, {28.0, 83}, {28.5, 84}, {29.0, 85},
+        {29.5, 86}, {30.0, 87}, {30.5, 88}
+    };
+    auto it = lookupTable.find(fromCelsius);
+    if (it != lookupTable.end()) return it->second;
+    return roundf(fromCelsius * 1.8 + 32.0);
+}
+
+static float baselineToCelsius(float fromFahrenheit) {
+    const std::map<int, float> lookupTable = {
+        {61, 16.0}, {62, 16.5}, {63, 17.0}, {64, 17.5}, {65, 18.0},
+        {66, 18.5}, {67, 19.0}, {68, 20.0}, {69, 21.0}, {70, 21.5},
+        {71, 22.0}, {72, 22.5}, {73, 23.0}, {74, 23.5}, {75, 24.0},
+        {76, 24.5}, {77, 25.0}, {78, 25.5}, {79, 26.0}, {80, 26.5},
+        {81, 27.0}, {82, 27.5}, {83, 28.0}, {84, 28.5}, {85, 29.0},
+        {86, 29.5}, {87, 30.0}, {88, 30.5}
+    };
+    auto it = lookupTable.find(static_cast<int>(fromFahrenheit));
+    if (it != lookupTable.end()) return it->second;
+    return roundf((fromFahrenheit - 32.0) / 1.8 * 2) / 2.0;
+}
+
+// One string per byte, like String(byte, HEX) + " "
+static std::string baselinePacketToHex(const uint8_t* packet, size_t length) {
+  std::string message;
+  for (size_t idx = 0; idx < length; idx++) {
+    char hex[3];
+    snprintf(hex, sizeof(hex), "%x", packet[idx]);
+    if (packet[idx] < 16) message += "0";
+    message += std::string(hex) + " ";
+  }
+  return message;
+}
+
+static const uint8_t packet[22] = {
+  0xfc, 0x62, 0x01, 0x30, 0x10, 0x02, 0x00, 0x00, 0x01, 0x01, 0x07,
+  0x00, 0x00, 0x00, 0x00, 0x03, 0xb1, 0x00, 0x00, 0x00, 0x00, 0x9e
+};
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_bench_conversions() {
+  // Setpoints of the remote and values between them, like a /control render
+  Measure table = measure("toFahrenheit", 50000, [](uint32_t i) { floatSink = toFahrenheit(16 + (i % 40) * 0.4f); });
+  Measure map = measure("toFahrenheit std::map", 50000, [](uint32_t i) { floatSink = baselineToFahrenheit(16 + (i % 40) * 0.4f); });
+  TEST_ASSERT_EQUAL(0, table.allocs);
+  TEST_ASSERT_TRUE(map.allocs >= 28 * 50000);
+
+  table = measure("toCelsius", 50000, [](uint32_t i) { floatSink = toCelsius(55 + (i % 40)); });
+  map = measure("toCelsius std::map", 50000, [](uint32_t i) { floatSink = baselineToCelsius(55 + (i % 40)); });
+  TEST_ASSERT_EQUAL(0, table.allocs);
+  TEST_ASSERT_TRUE(map.allocs >= 28 * 50000);
+}
+
+void test_bench_uptime() {
+  // Fits the small string buffer of the host, the cost is sprintf
+  measure("getUpTime", 50000, [](uint32_t i) {
+    hostMillis += i;
+    sizeSink = getUpTime().length();
+  });
+}
+
+void test_bench_packet_hex() {
+  char message[sizeof(packet) * 3 + 1];
+  Measure hex = measure("packetToHex", 50000, [&message](uint32_t) {
+    packetToHex(packet, sizeof(packet), message);
+    sizeSink = message[0];
+  });
+  Measure strings = measure("packet hex String", 50000, [](uint32_t) {
+    sizeSink = baselinePacketToHex(packet, sizeof(packet)).length();
+  });
+  TEST_ASSERT_EQUAL(0, hex.allocs);
+  TEST_ASSERT_TRUE(strings.allocs > 0);
+  TEST_ASSERT_EQUAL_STRING(baselinePacketToHex(packet, sizeof(packet)).c_str(), message);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_bench_conversions);
+  RUN_TEST(test_bench_uptime);
+  RUN_TEST(test_bench_packet_hex);
+  return UNITY_END();
+}
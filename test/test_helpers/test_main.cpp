@@ -0,0 +1,129 @@
+#include <unity.h>
+#include "util.h"
+#include "fixedstring.h"
+#include "spscqueue.h"
+#include "ratelimit.h"
+
+void setUp() {
+  hostMillis = 1000;
+}
+
+void tearDown() {}
+
+void test_crc32_check_value() {
+  const char* check = "123456789";
+  TEST_ASSERT_EQUAL_HEX32(0xCBF43926, getCrc32((const uint8_t*)check, strlen(check)));
+  TEST_ASSERT_EQUAL_HEX32(0x00000000, getCrc32(nullptr, 0));
+}
+
+void test_packet_to_hex() {
+  const uint8_t packet[] = { 0xfc, 0x62, 0x01, 0x0a };
+  char out[sizeof(packet) * 3 + 1];
+  packetToHex(packet, sizeof(packet), out);
+  TEST_ASSERT_EQUAL_STRING("fc 62 01 0a ", out);
+  packetToHex(packet, 0, out);
+  TEST_ASSERT_EQUAL_STRING("", out);
+}
+
+void test_fixedstring_truncates() {
+  FixedString<4> s = "abcdef";
+  TEST_ASSERT_EQUAL_STRING("abcd", s.c_str());
+  TEST_ASSERT_EQUAL(4, s.length());
+  s = "ab";
+  s += "cdef";
+  TEST_ASSERT_EQUAL_STRING("abcd", s.c_str());
+}
+
+void test_fixedstring_compare() {
+  FixedString<8> s = "abc";
+  TEST_ASSERT_TRUE(s == "abc");
+  TEST_ASSERT_TRUE(s == String("abc"));
+  TEST_ASSERT_TRUE(s != "abd");
+  s = (const char*)nullptr;
+  TEST_ASSERT_TRUE(s.isEmpty());
+  TEST_ASSERT_TRUE(s == nullptr);
+  s = "xyz";
+  s = s.c_str();
+  TEST_ASSERT_EQUAL_STRING("xyz", s.c_str());
+}
+
+void test_spscqueue_order_and_drops() {
+  SpscQueue<uint32_t, 4> queue;
+  uint32_t item;
+  TEST_ASSERT_FALSE(queue.pop(item));
+
+  // Several rounds, the indexes wrap around the storage
+  for (uint32_t round = 0; round < 3; round++) {
+    for (uint32_t i = 0; i < 4; i++) TEST_ASSERT_TRUE(queue.push(round * 10 + i));
+    TEST_ASSERT_FALSE(queue.push(99));
+    TEST_ASSERT_EQUAL(4, queue.size());
+    for (uint32_t i = 0; i < 4; i++) {
+      TEST_ASSERT_TRUE(queue.pop(item));
+      TEST_ASSERT_EQUAL(round * 10 + i, item);
+    }
+    TEST_ASSERT_FALSE(queue.pop(item));
+  }
+  TEST_ASSERT_EQUAL(3, queue.dropped());
+}
+
+void test_tokenbucket_refill() {
+  TokenBucket bucket;
+  // 2 tokens, 60 per minute: one per second
+  TEST_ASSERT_EQUAL(0, bucket.take(2, 60, 1, 0));
+  TEST_ASSERT_EQUAL(0, bucket.take(2, 60, 1, 0));
+  TEST_ASSERT_EQUAL(1000, bucket.take(2, 60, 1, 0));
+  TEST_ASSERT_EQUAL(500, bucket.take(2, 60, 1, 500));
+  TEST_ASSERT_EQUAL(0, bucket.take(2, 60, 1, 1000));
+  // A long idle time only fills the bucket
+  TEST_ASSERT_EQUAL(0, bucket.take(2, 60, 2, 3600000));
+  TEST_ASSERT_EQUAL(1000, bucket.take(2, 60, 1, 3600000));
+}
+
+void test_ratelimiter_client_burst() {
+  RateLimiter limiter;
+  // RATE_JSON: 10 at once, then 120 per minute for a client
+  for (uint8_t i = 0; i < 10; i++) TEST_ASSERT_EQUAL(0, limiter.admit(1, RATE_JSON));
+  TEST_ASSERT_EQUAL(1, limiter.admit(1, RATE_JSON));
+  TEST_ASSERT_EQUAL(1, limiter.rejected);
+  // Another client and another endpoint have their own budget
+  TEST_ASSERT_EQUAL(0, limiter.admit(2, RATE_JSON));
+  TEST_ASSERT_EQUAL(0, limiter.admit(1, RATE_CONTROL));
+
+  hostMillis += 500;
+  TEST_ASSERT_EQUAL(0, limiter.admit(1, RATE_JSON));
+}
+
+void test_ratelimiter_replaces_oldest_client() {
+  RateLimiter limiter;
+  for (uint8_t i = 0; i < 10; i++) limiter.admit(1, RATE_JSON);
+  TEST_ASSERT_NOT_EQUAL(0, limiter.admit(1, RATE_JSON));
+
+  // Client 1 is the least recently seen once the table is full, its slot starts again
+  for (uint32_t ip = 2; ip < 2 + RATE_MAX_CLIENTS; ip++) {
+    hostMillis += 1;
+    limiter.admit(ip, RATE_SUBSCRIPTIONS);
+  }
+  TEST_ASSERT_EQUAL(0, limiter.admit(1, RATE_JSON));
+}
+
+void test_ratelimiter_writes() {
+  RateLimiter limiter;
+  TEST_ASSERT_EQUAL(0, limiter.admitWrites(0));
+  TEST_ASSERT_EQUAL(0, limiter.admitWrites(RATE_WRITES_BURST));
+  // 2 s for one more command at 30 per minute
+  TEST_ASSERT_EQUAL(2, limiter.admitWrites(1));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_crc32_check_value);
+  RUN_TEST(test_packet_to_hex);
+  RUN_TEST(test_fixedstring_truncates);
+  RUN_TEST(test_fixedstring_compare);
+  RUN_TEST(test_spscqueue_order_and_drops);
+  RUN_TEST(test_tokenbucket_refill);
+  RUN_TEST(test_ratelimiter_client_burst);
+  RUN_TEST(test_ratelimiter_replaces_oldest_client);
+  RUN_TEST(test_ratelimiter_writes);
+  return UNITY_END();
+}
@@ -0,0 +1,94 @@
+#include <unity.h>
+#include <map>
+#include "temperature.h"
+
+// The conversions before the constexpr tables, the tables must give exactly the same results
+static float baselineToFahrenheit(float fromCelsius) {
+    const std::map<float, int> lookupTable = {
+        {16.0, 61}, {16.5, 62}, {17.0, 63}, {17.5, 64}, {18.0, 65},
+        {18.5, 66}, {19.0, 67}, {20.0, 68}, {21.0, 69}, {21.5, 70},
+        {22.0, 71}, {22.5, 72}, {23.0, 73}, {23.5, 74}, {24.0, 75},
+        {24.5, 76}, {25.0, 77}, {25.5, 78}, {26.0, 79}, {26.5, 80},
+        {27.0, 81}, {27.5, 82}, {28.0, 83}, {28.5, 84}, {29.0, 85},
+        {29.5, 86}, {30.0, 87}, {30.5, 88}
+    };
+    auto it = lookupTable.find(fromCelsius);
+    if (it != lookupTable.end()) return it->second;
+    return roundf(fromCelsius * 1.8 + 32.0);
+}
+
+static float baselineToCelsius(float fromFahrenheit) {
+    const std::map<int, float> lookupTable = {
+        {61, 16.0}, {62, 16.5}, {63, 17.0}, {64, 17.5}, {65, 18.0},
+        {66, 18.5}, {67, 19.0}, {68, 20.0}, {69, 21.0}, {70, 21.5},
+        {71, 22.0}, {72, 22.5}, {73, 23.0}, {74, 23.5}, {75, 24.0},
+        {76, 24.5}, {77, 25.0}, {78, 25.5}, {79, 26.0}, {80, 26.5},
+        {81, 27.0}, {82, 27.5}, {83, 28.0}, {84, 28.5}, {85, 29.0},
+        {86, 29.5}, {87, 30.0}, {88, 30.5}
+    };
+    auto it = lookupTable.find(static_cast<int>(fromFahrenheit));
+    if (it != lookupTable.end()) return it->second;
+    return roundf((fromFahrenheit - 32.0) / 1.8 * 2) / 2.0;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_remote_setpoints() {
+  TEST_ASSERT_EQUAL_FLOAT(61, toFahrenheit(16.0));
+  TEST_ASSERT_EQUAL_FLOAT(67, toFahrenheit(19.5));
+  TEST_ASSERT_EQUAL_FLOAT(88, toFahrenheit(30.5));
+  TEST_ASSERT_EQUAL_FLOAT(16.0, toCelsius(61));
+  TEST_ASSERT_EQUAL_FLOAT(20.0, toCelsius(68));
+  TEST_ASSERT_EQUAL_FLOAT(30.5, toCelsius(88));
+}
+
+void test_tables_match_baseline() {
+  // Every half degree of the remote, and the ones just outside
+  for (int half = 28; half <= 66; half++) {
+    TEST_ASSERT_EQUAL_FLOAT(baselineToFahrenheit(half / 2.0f), toFahrenheit(half / 2.0f));
+  }
+  for (int f = 55; f <= 95; f++) {
+    TEST_ASSERT_EQUAL_FLOAT(baselineToCelsius(f), toCelsius(f));
+  }
+}
+
+void test_between_entries_match_baseline() {
+  // Tenths of a degree, from below freezing to above the unit range
+  for (int tenth = -200; tenth <= 450; tenth++) {
+    TEST_ASSERT_EQUAL_FLOAT(baselineToFahrenheit(tenth / 10.0f), toFahrenheit(tenth / 10.0f));
+  }
+  for (int tenth = -100; tenth <= 1100; tenth++) {
+    TEST_ASSERT_EQUAL_FLOAT(baselineToCelsius(tenth / 10.0f), toCelsius(tenth / 10.0f));
+  }
+}
+
+void test_setpoints_round_trip() {
+  for (int f = 61; f <= 88; f++) {
+    TEST_ASSERT_EQUAL_FLOAT(f, toFahrenheit(toCelsius(f)));
+  }
+}
+
+void test_outside_the_remote_range() {
+  TEST_ASSERT_EQUAL_FLOAT(50, toFahrenheit(10.0));
+  TEST_ASSERT_EQUAL_FLOAT(10.0, toCelsius(50));
+  TEST_ASSERT_EQUAL_FLOAT(-18.0, toCelsius(0));
+}
+
+void test_measures_keep_their_decimals() {
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 0.0, fahrenheitToCelsius(32));
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 21.278, fahrenheitToCelsius(70.3));
+  TEST_ASSERT_FLOAT_WITHIN(0.001, -40.0, fahrenheitToCelsius(-40));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_remote_setpoints);
+  RUN_TEST(test_tables_match_baseline);
+  RUN_TEST(test_between_entries_match_baseline);
+  RUN_TEST(test_setpoints_round_trip);
+  RUN_TEST(test_outside_the_remote_range);
+  RUN_TEST(test_measures_keep_their_decimals);
+  return UNITY_END();
+}
@@ -0,0 +1,357 @@
+#!/usr/bin/env python3
+"""CN105 indoor unit simulator, for running the firmware UART path without a heat pump.
+
+Answers the packets sent by the SwiCago HeatPump library (connect, info requests, settings and
+remote temperature) on a pseudo-terminal, or on a real serial port wired to the ESP (2400 8E1).
+The unit follows a small thermal model: the compressor ramps toward a frequency given by the gap
+to the setpoint, and the room drifts toward the outside temperature.
+
+    tools/cn105sim.py --latency 80 --jitter 40 --loss 0.02 --corrupt 0.01 --script soak.txt
+    tools/cn105sim.py --device /dev/ttyUSB0
+
+The status line also measures the firmware side: packets per second, and the time it takes to send
+its next packet once a reply went out (p50/p99), which includes the UART reading and parsing.
+
+A script has one change per line, "<seconds> <key>=<value> ...", applied at that time after
+start: room, outside, power (0/1), mode, setpoint, fan, vane, latency, jitter, loss, corrupt.
+"""
+
+import argparse
+import heapq
+import os
+import random
+import select
+import sys
+import termios
+import time
+import tty
+
+PACKET_START = 0xFC
+TYPE_SET = 0x41
+TYPE_INFO = 0x42
+TYPE_CONNECT = 0x5A
+REPLY_SET = 0x61
+REPLY_INFO = 0x62
+REPLY_CONNECT = 0x7A
+
+INFO_SETTINGS = 0x02
+INFO_ROOM_TEMP = 0x03
+INFO_STATUS = 0x06
+
+SET_SETTINGS = 0x01
+SET_REMOTE_TEMP = 0x07
+
+MODES = {0x01: "HEAT", 0x02: "DRY", 0x03: "COOL", 0x07: "FAN", 0x08: "AUTO"}
+MODE_BYTES = {name: value for value, name in MODES.items()}
+
+COMPRESSOR_MAX_HZ = 90
+COMPRESSOR_RAMP_HZ = 3        # per second, up or down
+HZ_PER_DEGREE = 25            # target frequency for each degree away from the setpoint
+DEGREES_PER_HZ_SECOND = 0.0002
+LEAK_PER_SECOND = 0.0005      # part of the gap to the outside lost each second
+
+
+def checksum(data):
+    return (PACKET_START - sum(data)) & 0xFF
+
+
+def packet(kind, payload):
+    body = bytes([PACKET_START, kind, 0x01, 0x30, len(payload)]) + bytes(payload)
+    return body + bytes([checksum(body)])
+
+
+class Unit:
+    def __init__(self, room, outside):
+        self.power = 0
+        self.mode = 0x01
+        self.setpoint = 22.0
+        self.fan = 0x00
+        self.vane = 0x00
+        self.wide_vane = 0x03
+        self.room = room
+        self.outside = outside
+        self.remote = None          # room temperature given by the firmware, replaces the sensor
+        self.frequency = 0.0
+
+    def measured(self):
+        return self.remote if self.remote is not None else self.room
+
+    def step(self, seconds):
+        # One second at most per step, a fast simulation stays stable
+        while seconds > 0:
+            self.step_once(min(1.0, seconds))
+            seconds -= 1.0
+
+    def step_once(self, seconds):
+        gap = self.setpoint - self.measured()
+        target = 0.0
+        if self.power:
+            if self.mode == 0x01 or (self.mode == 0x08 and gap > 0):
+                target = max(0.0, gap) * HZ_PER_DEGREE
+            elif self.mode in (0x02, 0x03) or (self.mode == 0x08 and gap < 0):
+                target = max(0.0, -gap) * HZ_PER_DEGREE
+        target = min(target, COMPRESSOR_MAX_HZ)
+        ramp = COMPRESSOR_RAMP_HZ * seconds
+        self.frequency += max(-ramp, min(ramp, target - self.frequency))
+
+        heating = self.mode == 0x01 or (self.mode == 0x08 and gap > 0)
+        push = self.frequency * DEGREES_PER_HZ_SECOND * seconds
+        self.room += push if heating else -push
+        self.room += (self.outside - self.room) * LEAK_PER_SECOND * seconds
+
+    def settings(self):
+        data = bytearray(16)
+        data[0] = INFO_SETTINGS
+        data[3] = self.power
+        data[4] = self.mode
+        data[5] = max(0, min(15, 31 - int(self.setpoint)))
+        data[6] = self.fan
+        data[7] = self.vane
+        data[10] = self.wide_vane
+        data[11] = int(round(self.setpoint * 2)) + 128
+        return data
+
+    def room_temp(self):
+        data = bytearray(16)
+        data[0] = INFO_ROOM_TEMP
+        room = self.measured()
+        data[3] = max(0, min(31, int(room) - 10))
+        data[6] = int(round(room * 2)) + 128
+        return data
+
+    def status(self):
+        data = bytearray(16)
+        data[0] = INFO_STATUS
+        data[3] = int(round(self.frequency))
+        data[4] = 1 if self.frequency > 0 else 0
+        return data
+
+    def apply_settings(self, data):
+        flags = data[1]
+        if flags & 0x01:
+            self.power = data[3]
+        if flags & 0x02:
+            self.mode = data[4]
+        if flags & 0x04:
+            self.setpoint = (data[14] - 128) / 2 if data[14] else 31 - data[5]
+        if flags & 0x08:
+            self.fan = data[6]
+        if flags & 0x10:
+            self.vane = data[7]
+        if data[2] & 0x01:
+            self.wide_vane = data[13]
+
+    def apply_remote_temp(self, data):
+        self.remote = (data[3] - 128) / 2 if data[1] else None
+
+
+class Link:
+    """Reads the packets sent by the firmware and sends the replies after the configured delay"""
+
+    def __init__(self, fd, unit, args, stats):
+        self.fd = fd
+        self.unit = unit
+        self.args = args
+        self.stats = stats
+        self.buffer = bytearray()
+        self.pending = []
+        self.sequence = 0
+        self.last_reply = None
+        self.turnarounds = []
+
+    def feed(self, data):
+        self.buffer += data
+        while True:
+            start = self.buffer.find(bytes([PACKET_START]))
+            if start < 0:
+                self.buffer.clear()
+                return
+            del self.buffer[:start]
+            if len(self.buffer) < 5:
+                return
+            length = 5 + self.buffer[4] + 1
+            if len(self.buffer) < length:
+                return
+            frame = bytes(self.buffer[:length])
+            if checksum(frame[:-1]) != frame[-1]:
+                # Resynchronise on the next start byte
+                self.stats["bad"] += 1
+                del self.buffer[:1]
+                continue
+            del self.buffer[:length]
+            self.handle(frame[1], frame[5:-1])
+
+    def handle(self, kind, data):
+        self.stats["received"] += 1
+        if self.last_reply is not None:
+            self.turnarounds.append(time.monotonic() - self.last_reply)
+            self.last_reply = None
+        if kind == TYPE_CONNECT:
+            reply = packet(REPLY_CONNECT, [0x00])
+        elif kind == TYPE_INFO and data:
+            info = {INFO_SETTINGS: self.unit.settings, INFO_ROOM_TEMP: self.unit.room_temp,
+                    INFO_STATUS: self.unit.status}.get(data[0])
+            payload = info() if info else bytearray([data[0]] + [0] * 15)
+            reply = packet(REPLY_INFO, payload)
+        elif kind == TYPE_SET and data:
+            if data[0] == SET_SETTINGS:
+                self.unit.apply_settings(data)
+            elif data[0] == SET_REMOTE_TEMP:
+                self.unit.apply_remote_temp(data)
+            reply = packet(REPLY_SET, [0] * 16)
+        else:
+            self.stats["unknown"] += 1
+            return
+
+        if random.random() < self.args.loss:
+            self.stats["lost"] += 1
+            return
+        if random.random() < self.args.corrupt:
+            self.stats["corrupted"] += 1
+            reply = reply[:-1] + bytes([reply[-1] ^ 0xFF])
+        delay = max(0.0, self.args.latency + random.uniform(-self.args.jitter, self.args.jitter)) / 1000
+        self.sequence += 1
+        heapq.heappush(self.pending, (time.monotonic() + delay, self.sequence, reply))
+
+    def take_turnarounds(self):
+        """p50 and p99 in ms since the last call, None without packets"""
+        values, self.turnarounds = sorted(self.turnarounds), []
+        if not values:
+            return None
+        return tuple(values[min(len(values) - 1, int(len(values) * q))] * 1000 for q in (0.5, 0.99))
+
+    def next_due(self):
+        return self.pending[0][0] if self.pending else None
+
+    def send_due(self, now):
+        while self.pending and self.pending[0][0] <= now:
+            _, _, reply = heapq.heappop(self.pending)
+            try:
+                os.write(self.fd, reply)
+                self.stats["sent"] += 1
+                self.last_reply = time.monotonic()
+            except OSError:
+                # Nobody has the pty open, the reply is lost like on an unplugged cable
+                self.stats["lost"] += 1
+
+
+def load_script(path):
+    steps = []
+    with open(path) as script:
+        for number, line in enumerate(script, 1):
+            line = line.split("#", 1)[0].strip()
+            if not line:
+                continue
+            at, *changes = line.split()
+            try:
+                steps.append((float(at), [change.split("=", 1) for change in changes]))
+            except ValueError:
+                sys.exit(f"{path}:{number}: expected '<seconds> key=value ...'")
+    return sorted(steps, key=lambda step: step[0])
+
+
+def apply_change(unit, args, key, value):
+    if key == "room":
+        unit.room = float(value)
+    elif key == "outside":
+        unit.outside = float(value)
+    elif key == "power":
+        unit.power = int(value)
+    elif key == "mode":
+        unit.mode = MODE_BYTES[value.upper()]
+    elif key == "setpoint":
+        unit.setpoint = float(value)
+    elif key == "fan":
+        unit.fan = int(value)
+    elif key == "vane":
+        unit.vane = int(value)
+    elif key in ("latency", "jitter", "loss", "corrupt"):
+        setattr(args, key, float(value))
+    else:
+        sys.exit(f"unknown script key {key}")
+
+
+def open_device(path):
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+    tty.setraw(fd)
+    attrs = termios.tcgetattr(fd)
+    attrs[2] |= termios.PARENB | termios.CS8 | termios.CLOCAL | termios.CREAD
+    attrs[2] &= ~(termios.PARODD | termios.CSTOPB)
+    attrs[4] = attrs[5] = termios.B2400
+    termios.tcsetattr(fd, termios.TCSANOW, attrs)
+    return fd, path
+
+
+def open_pty():
+    master, slave = os.openpty()
+    tty.setraw(slave)
+    # The slave stays open here, clients can come and go without closing the pty
+    return master, os.ttyname(slave)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--device", help="serial port to use instead of a pseudo-terminal")
+    parser.add_argument("--latency", type=float, default=50, help="reply delay in ms (default 50)")
+    parser.add_argument("--jitter", type=float, default=0, help="random +/- ms added to the delay")
+    parser.add_argument("--loss", type=float, default=0, help="probability of not answering a packet")
+    parser.add_argument("--corrupt", type=float, default=0, help="probability of a bad checksum")
+    parser.add_argument("--room", type=float, default=20, help="initial room temperature")
+    parser.add_argument("--outside", type=float, default=10, help="temperature the room drifts to")
+    parser.add_argument("--speed", type=float, default=1, help="simulated seconds per real second")
+    parser.add_argument("--script", help="file of timed state changes")
+    parser.add_argument("--stats", type=float, default=10, help="seconds between two status lines, 0 for none")
+    parser.add_argument("--seed", type=int, help="random seed, for repeatable runs")
+    args = parser.parse_args()
+
+    if args.seed is not None:
+        random.seed(args.seed)
+    fd, name = open_device(args.device) if args.device else open_pty()
+    print(f"CN105 simulator on {name}", flush=True)
+
+    unit = Unit(args.room, args.outside)
+    stats = dict.fromkeys(("received", "sent", "lost", "corrupted", "bad", "unknown"), 0)
+    link = Link(fd, unit, args, stats)
+    script = load_script(args.script) if args.script else []
+
+    start = last = last_stats = time.monotonic()
+    received_at_stats = 0
+    try:
+        while True:
+            now = time.monotonic()
+            due = link.next_due()
+            timeout = 0.1 if due is None else max(0.0, min(0.1, due - now))
+            readable, _, _ = select.select([fd], [], [], timeout)
+            if readable:
+                try:
+                    link.feed(os.read(fd, 256))
+                except OSError:
+                    # The pty has no reader yet
+                    time.sleep(0.1)
+
+            now = time.monotonic()
+            link.send_due(now)
+            unit.step((now - last) * args.speed)
+            last = now
+
+            elapsed = (now - start) * args.speed
+            while script and script[0][0] <= elapsed:
+                for key, value in script.pop(0)[1]:
+                    apply_change(unit, args, key, value)
+
+            if args.stats and now - last_stats >= args.stats:
+                rate = (stats["received"] - received_at_stats) / (now - last_stats)
+                received_at_stats = stats["received"]
+                last_stats = now
+                turnaround = link.take_turnarounds()
+                timing = f"turnaround p50={turnaround[0]:.0f}ms p99={turnaround[1]:.0f}ms " if turnaround else ""
+                print(f"{elapsed:8.0f}s power={unit.power} mode={MODES.get(unit.mode, unit.mode)} "
+                      f"set={unit.setpoint:.1f} room={unit.measured():.2f} compressor={unit.frequency:.0f}Hz "
+                      f"rate={rate:.1f}/s {timing}"
+                      + " ".join(f"{k}={v}" for k, v in stats.items()), flush=True)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()